@@ -2,22 +2,6 @@
 
 #Important: make sure this file has unix line endings
 
-grep -v "^\s*$" cfg/tagfd.conf | grep -v "^#.*$" | tr -d "\r" |
-while read line
-do
-    bin/tfdconfig t $line
-    if [[ $? -ne 0 ]]
-    then 
-        exit 1
-    fi
-done
-
-grep -v "^\s*$" cfg/tagfd.conf | grep -v "^#.*$" | tr -d "\r" |
-while read line
-do
-    bin/tfdconfig + $line
-    if [[ $? -ne 0 ]]
-    then 
-        exit 1
-    fi
-done
+# tfdconfig checks the whole file first, and then creates all of the tags in
+# a single write to /dev/tagfd.master.
+bin/tfdconfig f cfg/tagfd.conf
@@ -87,6 +87,10 @@
     tag 'B' (both), which has the same effect as 'I' but will make the intent
     behind your code clearer. 
     
+    Behind the scenes, only the trigger (see below) is actually watched for
+    changes. The other inputs are brought up to date from the shared tag table
+    just before RuleExec runs, which costs no system calls. 
+    
     
     TRIGGER
     -------
@@ -102,6 +106,15 @@
     the rule will be executed. You must choose an INPUT tag, or the rule will 
     never run. 
     
+    Optionally, you can also define TRIGGER_WAIT_MS (a number of milliseconds). 
+    The rule then waits for the trigger with a single system call per change 
+    (see assertReadTagTimeout), rather than polling it and then reading it, 
+    and checks the master killswitch whenever it wakes up, which is at least
+    every TRIGGER_WAIT_MS. Use it for rules whose trigger changes often. 
+    Example:
+    
+    #define TRIGGER_WAIT_MS 500
+    
     
     RuleInit
     --------
@@ -161,6 +174,7 @@ Check the rule-writing manual.
 #include <math.h>
 #include <stdbool.h>
 #include "tagfd-shared.h"
+#include "tagfd-toolkit.h"
 
 
 /*
@@ -179,6 +193,16 @@ Check the rule-writing manual.
 //  Writes the provided tag to tagfd, and updates it's timestamp to now.
 void WriteTag(tag_t * tag);
 
+/*  Writes several tags at once (updating their timestamps to now), as a 
+    single transaction: other programs never see some of them updated and 
+    others not, if they read them with a snapshot (see snapshotTags). Use 
+    this when outputs have to change together, e.g. a mode and a setpoint.
+    Example: 
+    
+    tag_t * outputs[] = { &mode, &setpoint };
+    WriteTags(outputs, 2);                          */
+void WriteTags(tag_t ** tags, int count);
+
 /*  Writes a message to the logs. Please only log abnormal things. 
     It works like printf, but you must provide a priority.
     The priority can be any of the syslog priority macros (see man 3 syslog)
@@ -220,15 +244,12 @@ void LogAbort(int priority, const char * format, ...);
 int assertOpenTag(const char * name)
 {  
 
-    char buf[TAG_NAME_LENGTH + 100];
-    memset(buf, 0, (TAG_NAME_LENGTH + 100) * sizeof(char));
-    int rc = snprintf(buf, TAG_NAME_LENGTH + 100, "/dev/tagfd/%s", name);
-    if(rc < 1 || rc == TAG_NAME_LENGTH + 100)
+    if(strlen(name) >= TAG_NAME_LENGTH)
         LogAbort(LOG_ERR,"Encountered a tag name that was too long.");
 
-    int fd = open (buf, O_CLOEXEC | O_RDWR);
+    int fd = openTag(name, O_CLOEXEC | O_RDWR);
     if(fd < 0)
-        LogAbort(LOG_ERR, "Couldn't open %s: %s",buf,strerror(errno));
+        LogAbort(LOG_ERR, "Couldn't open tag %s: %s",name,strerror(errno));
         
     return fd;
 }
@@ -244,6 +265,25 @@ tag_t assertReadTag(int fd)
     return tag;
 }
 
+// Waits up to timeoutMs (-1: forever) for a new value of a tag and reads it, in
+// one system call, or dies trying. Returns false if there was no new value in time.
+bool assertReadTagTimeout(int fd, int timeoutMs, tag_t * tag)
+{
+    tagx_t tagx;
+    uint64_t timeout = timeoutMs < 0 ? TAGFD_WAIT_FOREVER : (uint64_t)timeoutMs * 1000000;
+    
+    while(!waitReadTag(fd, timeout, &tagx))
+    {
+        if(errno == ETIMEDOUT)
+            return false;
+        if(errno != EINTR)
+            LogAbort(LOG_ERR, "Wait-read call to tag failed: %s", strerror(errno));
+    }
+    
+    *tag = tagx.tag;
+    return true;
+}
+
 // Writes an tag to an open file descriptor, or dies trying.
 void assertWriteTag(int fd, tag_t tag)
 {
@@ -284,6 +324,20 @@ void setTagTimestamp(tag_t * tag)
 	tag->timestamp += spec.tv_nsec / 1000000;
 }
 
+// Same as above, but for extended tags (full resolution timestamp). 
+// Use this with file descriptors in extended mode (see setTagFlags) when a 
+// tag needs to be updated more often than once a millisecond.
+void setTagTimestampNs(tagx_t * tag)
+{
+    struct timespec spec;
+
+    clock_gettime(CLOCK_REALTIME, &spec);
+	
+	tag->timestamp_ns = spec.tv_sec;
+	tag->timestamp_ns *= 1000000000;
+	tag->timestamp_ns += spec.tv_nsec;
+}
+
 
 void Log(int priority, const char * format, ...)
 {    
@@ -407,9 +461,21 @@ char * _toolkit_tagNames[] = {
 // Record the number of tags in use
 #define _TOOLKIT_NUM_TAGS (sizeof(_toolkit_tagPtrs)/sizeof(tag_t*))
 
-// Create a list of pollfds
-static
-struct pollfd _toolkit_pollfds[_TOOLKIT_NUM_TAGS] ;
+// File descriptors and shared table IDs of the tags
+static int _toolkit_fds[_TOOLKIT_NUM_TAGS];
+static int _toolkit_tagIds[_TOOLKIT_NUM_TAGS];
+
+// The bulk device, for the initial read and for WriteTags
+static int _toolkit_bulkfd;
+
+// The shared tag table. Inputs other than the trigger and the master 
+// killswitch are refreshed from here, rather than polled and read. 
+static tag_table_t * _toolkit_table;
+
+// We only poll the master killswitch and the trigger. 
+#define _TOOLKIT_KILLSWITCH_PFD 0
+#define _TOOLKIT_TRIGGER_PFD    1
+static struct pollfd _toolkit_pollfds[2];
 
 
 
@@ -422,88 +488,176 @@ void WriteTag(tag_t * tag)
         if(_toolkit_tagPtrs[i] == tag)
         {
             setTagTimestamp(tag);
-            assertWriteTag(_toolkit_pollfds[i].fd, *tag);
+            assertWriteTag(_toolkit_fds[i], *tag);
             return;
         }
     }
     LogAbort(LOG_ERR, "Invalid tag pointer passed to WriteTag()");
 }
 
+void WriteTags(tag_t ** tags, int count)
+{
+    struct tag_bulk_entry entries[TAGFD_TX_MAX];
+    
+    if(count < 0 || count > TAGFD_TX_MAX)
+        LogAbort(LOG_ERR, "Too many tags passed to WriteTags(): %d", count);
+    
+    for(int j = 0; j < count; j++)
+    {
+        int i;
+        for(i = 0; i < _TOOLKIT_NUM_TAGS; i++)
+            if(_toolkit_tagPtrs[i] == tags[j])
+                break;
+        if(i == _TOOLKIT_NUM_TAGS)
+            LogAbort(LOG_ERR, "Invalid tag pointer passed to WriteTags()");
+        
+        setTagTimestamp(tags[j]);
+        memset(&entries[j], 0, sizeof(entries[j]));
+        entries[j].id = _toolkit_tagIds[i];
+        entries[j].tag.tag = *tags[j];
+    }
+    
+    if(!txWriteTags(_toolkit_bulkfd, entries, count, 0))
+    {
+        for(int j = 0; j < count; j++)
+            if(errno == ECANCELED && entries[j].status != -ECANCELED)
+                LogAbort(LOG_ERR, "Transaction failed: %s", strerror(-entries[j].status));
+        LogAbort(LOG_ERR, "Transaction failed: %s", strerror(errno));
+    }
+}
+
 void RuleInit(void);
 void RuleExec(void);
 
+// Checks the revents of one of our pollfds and reads the tag if it's ready. 
+// Returns true if the tag was read. 
+static bool _toolkit_pollRead(int pfdIdx, int tagIdx)
+{
+    short revents = _toolkit_pollfds[pfdIdx].revents;
+    
+    if(!revents) 
+        return false;
+    
+    // Is the pending event "normal read is now possible?"
+    // Probably revise this at some point... but for now any other event will log an error and abort.
+    if(revents != POLLIN && revents != (POLLIN | POLLRDNORM))
+        LogAbort(LOG_ERR,"Poll: unexpected revents (%d) for tag %s", revents, _toolkit_tagNames[tagIdx]);
+    
+    *(_toolkit_tagPtrs[tagIdx]) = assertReadTag(_toolkit_fds[tagIdx]);
+    return true;
+}
+
 int main(int argc, char ** argv)
 {
     openlog(RULENAME, LOG_NDELAY, LOG_USER);
     
-    memset(_toolkit_pollfds, 0, _TOOLKIT_NUM_TAGS * sizeof(struct pollfd));
+    memset(_toolkit_pollfds, 0, sizeof(_toolkit_pollfds));
+    
+    _toolkit_table = tagTableOpen();
+    if(!_toolkit_table)
+        LogAbort(LOG_ERR, "Couldn't map the shared tag table: %s", strerror(errno));
+    
+    // Make sure the trigger they provided is actually in the list. 
+    int triggerIdx = -1;
+    for(int i = 0; i < _TOOLKIT_NUM_TAGS; i++)
+        if(_toolkit_tagPtrs[i] == &TRIGGER) 
+            triggerIdx = i;
     
-    // loop over tags the rule writer provided, and do our setup. 
+    if(triggerIdx < 0)
+        LogAbort(LOG_ERR, "Invalid TRIGGER was detected.");
+    
+    // loop over tags the rule writer provided, and open them. 
+    struct tag_bulk_entry initial[_TOOLKIT_NUM_TAGS];
     for(int i = 0; i < _TOOLKIT_NUM_TAGS; i++)
     {
-        // open the tag and perform initial read.
-        _toolkit_pollfds[i].fd = assertOpenTag(_toolkit_tagNames[i]);
-        *(_toolkit_tagPtrs[i]) = assertReadTag(_toolkit_pollfds[i].fd);
+        _toolkit_fds[i] = assertOpenTag(_toolkit_tagNames[i]);
         
-        // check the datatype matches expectation
-        assertTagDataType(*(_toolkit_tagPtrs[i]), _toolkit_tagDTypes[i]);
+        _toolkit_tagIds[i] = getTagId(_toolkit_fds[i]);
+        if(_toolkit_tagIds[i] < 0)
+            LogAbort(LOG_ERR, "Couldn't get ID of tag %s: %s", _toolkit_tagNames[i], strerror(errno));
         
-        // set the poll events based on I/O setting. 
-        if(_toolkit_tagModes[i] == 'I' || _toolkit_tagModes[i] == 'B')
-            _toolkit_pollfds[i].events = POLLIN;
+        initial[i].id = _toolkit_tagIds[i];
     }
     
-    // Make sure the trigger they provided is actually in the list. 
-    for(int i = 0; i < _TOOLKIT_NUM_TAGS; i++)
-        if(_toolkit_tagPtrs[i] == &TRIGGER) 
-            goto allgood;
+    // perform the initial read of all the tags in one go. 
+    _toolkit_bulkfd = openBulk();
+    if(_toolkit_bulkfd < 0 || !bulkReadTags(_toolkit_bulkfd, initial, _TOOLKIT_NUM_TAGS))
+        LogAbort(LOG_ERR, "Initial bulk read failed: %s", strerror(errno));
     
-    LogAbort(LOG_ERR, "Invalid TRIGGER was detected.");
+    for(int i = 0; i < _TOOLKIT_NUM_TAGS; i++)
+    {
+        if(initial[i].status < 0)
+            LogAbort(LOG_ERR, "Couldn't read tag %s: %s", _toolkit_tagNames[i], strerror(-initial[i].status));
+        *(_toolkit_tagPtrs[i]) = initial[i].tag.tag;
+        
+        // check the datatype matches expectation
+        assertTagDataType(*(_toolkit_tagPtrs[i]), _toolkit_tagDTypes[i]);
+    }
     
-    allgood:
+    // set up polling. The trigger is only polled if it's an input, and only 
+    // once if it's the killswitch itself (a second read() would block). 
+    int npollfds = triggerIdx == 0 ? 1 : 2;
+    _toolkit_pollfds[_TOOLKIT_KILLSWITCH_PFD].fd = _toolkit_fds[0];
+    _toolkit_pollfds[_TOOLKIT_KILLSWITCH_PFD].events = POLLIN;
+    _toolkit_pollfds[_TOOLKIT_TRIGGER_PFD].fd = _toolkit_fds[triggerIdx];
+    if(_toolkit_tagModes[triggerIdx] == 'I' || _toolkit_tagModes[triggerIdx] == 'B')
+        _toolkit_pollfds[_TOOLKIT_TRIGGER_PFD].events = POLLIN;
     
     // CALL THEIR INITIALIZER
     RuleInit();
     
     // MAIN LOOP 
+#ifdef TRIGGER_WAIT_MS
+    // Wait on the trigger alone, and keep an eye on the killswitch through the table. 
+    while(_toolkit_masterKillswitch.value.u8 && _toolkit_pollfds[_TOOLKIT_TRIGGER_PFD].events)
+    {
+        bool triggered = assertReadTagTimeout(_toolkit_fds[triggerIdx], TRIGGER_WAIT_MS, _toolkit_tagPtrs[triggerIdx]);
+        
+        tagTableRead(_toolkit_table, _toolkit_tagIds[0], &_toolkit_masterKillswitch);
+        if(!triggered || !_toolkit_masterKillswitch.value.u8)
+            continue;
+        
+        for(int i = 1; i < _TOOLKIT_NUM_TAGS; i++)
+        {
+            if(i == triggerIdx) continue;
+            if(_toolkit_tagModes[i] == 'I' || _toolkit_tagModes[i] == 'B')
+                tagTableRead(_toolkit_table, _toolkit_tagIds[i], _toolkit_tagPtrs[i]);
+        }
+        
+        RuleExec();
+    }
+#endif
     while(_toolkit_masterKillswitch.value.u8)
     {
         // poll
-        if (0 > poll(_toolkit_pollfds,_TOOLKIT_NUM_TAGS,-1))
+        if (0 > poll(_toolkit_pollfds, npollfds, -1))
             LogAbort(LOG_ERR, "Poll failed: %s", strerror(errno));
         
-        // check all tags to see what happened.
-        for(int i = 0; i < _TOOLKIT_NUM_TAGS; i++)
+        bool triggered = _toolkit_pollRead(_TOOLKIT_KILLSWITCH_PFD, 0);
+        if(triggerIdx != 0)
+            triggered = _toolkit_pollRead(_TOOLKIT_TRIGGER_PFD, triggerIdx);
+        
+        if(triggered)
         {
-            
-            // did anything happen on the i-th tag?
-            if(_toolkit_pollfds[i].revents)
+            // Bring the other inputs up to date, then execute the rule. 
+            for(int i = 1; i < _TOOLKIT_NUM_TAGS; i++)
             {
-                // Is the pending event "normal read is now possible?"
-                if(_toolkit_pollfds[i].revents == POLLIN || _toolkit_pollfds[i].revents == (POLLIN | POLLRDNORM))
-                {
-                    // Read the tag. 
-                    *(_toolkit_tagPtrs[i]) = assertReadTag(_toolkit_pollfds[i].fd);
-                    
-                    
-                    // Check if this is the trigger, possibly execute the rule. 
-                    if(_toolkit_tagPtrs[i] == &TRIGGER)
-                        RuleExec();
-                }
-                // Probably revise this at some point... but for now any other event will log an error and abort.
-                else 
-                {
-                    LogAbort(LOG_ERR,"Poll: unexpected revents (%d) for tag %s", _toolkit_pollfds[i].revents, _toolkit_tagNames[i]);
-                }
+                if(i == triggerIdx) continue;
+                if(_toolkit_tagModes[i] == 'I' || _toolkit_tagModes[i] == 'B')
+                    tagTableRead(_toolkit_table, _toolkit_tagIds[i], _toolkit_tagPtrs[i]);
             }
+            
+            RuleExec();
         }
     }
     
     // Close fds (though currently I don't know how you'd ever get here)...
     for(int i = 0; i < _TOOLKIT_NUM_TAGS; i++)
     {
-        close(_toolkit_pollfds[i].fd);
+        close(_toolkit_fds[i]);
     }
+    close(_toolkit_bulkfd);
+    tagTableClose(_toolkit_table);
     
     exit(EXIT_SUCCESS);
 }
@@ -23,10 +23,13 @@
     This file is shared between kernel and userspace code.
     That is why it doesn't include <stdint.h> (or anything 
     else, for that matter). Include <stdint.h> in your
-    userspace code before including this file. 
+    userspace code before including this file. The one 
+    exception is <linux/ioctl.h>, which both sides can use.
     
 */
 
+#include <linux/ioctl.h>
+
 
 // Data type constants
 #define DT_INVALID 0
@@ -44,6 +47,11 @@
 #define DT_TIMESTAMP 12
 #define DT_STRING 13
 
+// Array tags (see TAGFD_ACTION_ARRAY) have DT_ARRAY set in their data type,
+// along with the data type of their elements. 
+#define DT_ARRAY 0x80
+#define DT_ELEMENT(dtype) ((dtype) & ~DT_ARRAY)
+
 // Upper two bits of the quality are used to indicate 
 // GOOD, UNCERTAIN, BAD, or DISCONNECTED.
 // Lower 14 bits reserved for "vendor" use. 
@@ -86,6 +94,18 @@ typedef struct tag_s
 	uint8_t       dtype;
 } tag_t;
 
+// Extended form of a tag. File descriptors in extended mode (see 
+// TAGFD_FLAG_EXTENDED) read and write these instead of a tag_t. 
+// The generation is maintained by the kernel: it is incremented by every
+// successful write, and is ignored when writing. When writing, timestamp_ns
+// is used and tag.timestamp is ignored (the kernel derives it).
+typedef struct tagx_s
+{
+	tag_t         tag;
+	uint64_t      generation;
+	uint64_t      timestamp_ns; // nanoseconds since the epoch
+} tagx_t;
+
 // Used by tfdconfig and the tagfd.master device
 // (for creation of tags).
 struct tag_config
@@ -95,4 +115,332 @@ struct tag_config
 	char     name[TAG_NAME_LENGTH];
 };
 
+// Other actions for a struct tag_config written to tagfd.master, on an 
+// existing tag (dtype is ignored for a delete). 
+// A deleted tag's device goes away, and its name can be used again (by a new 
+// tag, with a new ID). File descriptors that still have it open get EIDRM 
+// from read() and write(), including readers that were blocked waiting. 
+// A retyped tag keeps its ID, name and readers, but its value is reset to 
+// zero, with uncertain quality, in the new data type. Readers see that as 
+// a new value. 
+#define TAGFD_ACTION_DELETE '-'
+#define TAGFD_ACTION_RETYPE '~'
+
+// Creates a timer tag when written to tagfd.master (with config.action set
+// to TAGFD_ACTION_TIMER). Timer tags must have an unsigned integer data 
+// type. The module adds 1 to the value every period_ns nanoseconds (at 
+// least TAGFD_TIMER_MIN_NS), timestamped with the time it's written, and 
+// sets the quality to good. They can be written like any other tag. 
+#define TAGFD_ACTION_TIMER '@'
+#define TAGFD_TIMER_MIN_NS 100000
+struct tag_timer_config
+{
+	struct tag_config config;
+	uint64_t          period_ns;
+};
+
+// Creates an array tag when written to tagfd.master (with config.action set
+// to TAGFD_ACTION_ARRAY): a tag whose value is length elements of 
+// config.dtype, which can be any of the integer or real types, or 
+// DT_TIMESTAMP (use DT_UINT8 for bytes), at most TAGFD_ARRAY_MAX_BYTES in 
+// all. The tag's data type is DT_ARRAY | config.dtype, and its value is 
+// the length (value.u32). 
+// read() and write() on an array tag exchange the tag (tag_t or tagx_t, as 
+// usual) immediately followed by all of the elements, and the whole array 
+// changes at once. Other ways of reading the tag (the table, subscriptions, 
+// the journal, bulk reads) only see the tag, and other ways of writing it 
+// (bulk writes, CAS, ...) fail with EOPNOTSUPP, as do queue mode, aggregate
+// mode and TAGFD_IOC_WAITREAD. The array can also be mmap()ed (read-only) 
+// from the tag's file descriptor: see struct tag_array_shm. Array tags 
+// can't be retyped. 
+#define TAGFD_ACTION_ARRAY '['
+#define TAGFD_ARRAY_MAX_BYTES (1 << 20)
+struct tag_array_config
+{
+	struct tag_config config;
+	uint32_t          length;
+	uint32_t          reserved;
+};
+
+
+// The largest number of tags the module can be configured for (see the 
+// max_tags module parameter, which can be raised at runtime). 
+#define TAGFD_TAGS_LIMIT (1 << 19)
+
+// The shared tag table. /dev/tagfd.table can be mmap()ed (read-only) by 
+// anyone, and contains one of these entries per tag, indexed by tag ID. 
+// Up to TAGFD_TAGS_LIMIT entries can be mapped, but only the pages covering
+// the first max_tags entries (TAGFD_IOC_CAPACITY) can be accessed. 
+// The kernel increments the sequence before and after changing an entry,
+// so it is odd while an update is in progress. A reader that sees the 
+// same even sequence before and after copying the tag got a consistent 
+// copy. IDs that have no tag have a dtype of DT_INVALID.
+struct tag_shm_entry
+{
+	uint32_t  sequence;
+	uint32_t  reserved0;
+	tag_t     tag;
+	uint64_t  generation;
+	uint64_t  timestamp_ns;
+	uint64_t  reserved;
+};
+
+// What mmap() of an array tag's file descriptor maps: the tag, as in the 
+// shared table (with the same sequence number protocol), then two copies 
+// of the elements. Writers fill in the copy that isn't active, then switch
+// active over (along with the tag) in one short update of the sequence 
+// number, so a reader copies the active copy inside the protocol too. 
+// TAG_ARRAY_ELEMENTS gives the address of copy i. 
+struct tag_array_shm
+{
+	struct tag_shm_entry  entry;
+	uint32_t              length;       // number of elements
+	uint32_t              element_size; // in bytes
+	uint32_t              active;       // which copy of the elements is current (0 or 1)
+	uint8_t               reserved[52];
+	// followed by 2 * length * element_size bytes of elements
+};
+#define TAG_ARRAY_ELEMENTS(shm, i) \
+	((char *)((shm) + 1) + (size_t)(i) * (shm)->length * (shm)->element_size)
+
+// Change records, as returned by read() on /dev/tagfd.sub. A single read()
+// returns as many records as fit in the buffer, one per changed tag.
+struct tag_record
+{
+	uint32_t  id;
+	uint32_t  reserved;
+	tagx_t    tag;
+};
+
+// Journal entries, as returned by read() on /dev/tagfd.journal: every 
+// successful write to any tag, in order. seq increases by one per write, 
+// so a gap in it means the reader fell too far behind (see the journal_size
+// module parameter) and lost changes. TAGFD_IOC_GETOVERFLOW on the journal
+// gets (and resets) the number lost. A reader only sees writes made after
+// it opened the journal.
+struct tag_journal_entry
+{
+	uint64_t  seq;
+	uint32_t  id;
+	uint32_t  reserved;
+	tagx_t    tag;
+};
+
+// Bulk reads and writes through /dev/tagfd.bulk. The caller fills in the id
+// (and, for writes, the tag) of each entry, and the kernel fills in the 
+// status: 0 on success, or a negative errno value. The statuses match the 
+// errors returned by read() and write() on the tag itself, plus -ENOENT 
+// for an ID that doesn't exist.
+struct tag_bulk_entry
+{
+	uint32_t  id;
+	int32_t   status;
+	tagx_t    tag;
+};
+
+struct tag_bulk
+{
+	uint64_t  entries; // pointer to an array of struct tag_bulk_entry
+	uint32_t  count;   // number of entries in the array
+	uint32_t  flags;   // TAGFD_FLAG_*: for writes, TAGFD_FLAG_EXTENDED means 
+	                   // use timestamp_ns rather than tag.timestamp, and 
+	                   // TAGFD_FLAG_KERNELTIME means the module stamps them
+};
+
+// Change filter for a tag file descriptor (TAGFD_IOC_SETFILTER). Once set,
+// read() and poll() only report a new value if it passes the filter: 
+//  - deadband: the value differs from the last value read by more than this.
+//    It is in the tag's own data type, and only allowed for numeric tags. 
+//  - deadband_ppm: the same, but relative to the last value read, in parts
+//    per million (10000 is 1%). The larger of the two deadbands is used.
+//  - min_interval_ns: at least this long has passed since the last read.
+// A change in quality always gets past the deadbands. All zeros means no 
+// filter. Values that are held back aren't lost: the latest value is 
+// reported once it passes (e.g. when the interval is up). 
+struct tag_filter
+{
+	tagvalue_t  deadband;
+	uint32_t    deadband_ppm;
+	uint32_t    reserved;
+	uint64_t    min_interval_ns;
+};
+
+// What read() returns on a tag file descriptor in aggregate mode (see 
+// TAGFD_IOC_SETAGGREGATE): the latest value (always as a tagx_t), and 
+// statistics of every value written since the previous read, including 
+// the ones that were coalesced (or held back by a filter): 
+//  - updates: how many values were written.
+//  - min, max: the smallest and largest of them, in the tag's data type.
+//  - sum: their sum. For integer tags this is the plain sum, for real tags
+//    it is in fixed point, with 32 fraction bits (divide by 2^32). It 
+//    saturates rather than overflowing.
+// numeric is 0 for data types that aren't numbers (strings, timestamps), 
+// in which case only updates is meaningful. If updates is 0 (the first 
+// read, for instance), min, max and sum are all zero. 
+struct tag_aggregate
+{
+	tagx_t      tag;
+	uint64_t    updates;
+	tagvalue_t  min;
+	tagvalue_t  max;
+	int64_t     sum;
+	uint32_t    numeric;
+	uint32_t    reserved;
+};
+
+// A read with a timeout (TAGFD_IOC_WAITREAD): waits up to timeout_ns for 
+// a new value, just as a blocking read() would (filters included), and 
+// returns it in tag (always as a tagx_t). A timeout of 0 doesn't wait at
+// all, and TAGFD_WAIT_FOREVER waits as long as it takes. 
+struct tag_waitread
+{
+	uint64_t    timeout_ns;
+	tagx_t      tag;
+};
+#define TAGFD_WAIT_FOREVER UINT64_MAX
+
+// Compare-and-swap on a tag (TAGFD_IOC_CAS). If the tag's value is 
+// currently equal to expected, tag is written, just as by write() (the
+// file descriptor's extended mode decides which timestamp is used), and 
+// swapped is set to 1. Otherwise nothing is written, and swapped is 0. 
+// Either way, tag is filled in with the tag as it now is, so a failed swap
+// can be retried with it. Values are compared bit for bit, over the size 
+// of the tag's data type (so for reals, -0.0 and 0.0 differ).
+struct tag_cas
+{
+	tagvalue_t  expected;
+	tagx_t      tag;
+	uint32_t    swapped;
+	uint32_t    reserved;
+};
+
+// Atomic add on a tag with an integer data type (TAGFD_IOC_FETCHADD). 
+// delta is added to the tag's value, wrapping around at the width of the 
+// data type, and the result is written with the timestamp, quality and 
+// dtype in tag, just as by write(). On return, old holds the value from 
+// before the add, and tag holds the tag as written.
+struct tag_fetchadd
+{
+	int64_t     delta;
+	tagvalue_t  old;
+	tagx_t      tag;
+};
+
+// Name to ID lookups through /dev/tagfd.bulk.
+struct tag_lookup
+{
+	char      name[TAG_NAME_LENGTH]; // the tag's name, e.g. "timer.1sec" (not its path)
+	uint32_t  id;                    // filled in by the kernel
+};
+
+
+// ioctl commands
+#define TAGFD_IOC_MAGIC 0xD7
+
+// On a tag: get the tag's ID (its index in the shared tag table).
+#define TAGFD_IOC_GETID      _IOR(TAGFD_IOC_MAGIC, 1, uint32_t)
+
+// On /dev/tagfd.table: get the number of usable entries in the table (max_tags).
+// This can grow while the module is loaded.
+#define TAGFD_IOC_CAPACITY   _IOR(TAGFD_IOC_MAGIC, 2, uint32_t)
+
+// On a tag: get or set the flags of this file descriptor (TAGFD_FLAG_*).
+#define TAGFD_IOC_GETFLAGS   _IOR(TAGFD_IOC_MAGIC, 3, uint32_t)
+#define TAGFD_IOC_SETFLAGS   _IOW(TAGFD_IOC_MAGIC, 4, uint32_t)
+
+// On /dev/tagfd.sub: add or remove a tag (by ID) from this file descriptor's
+// subscription set. A newly subscribed tag is reported once right away.
+#define TAGFD_IOC_SUBSCRIBE   _IOW(TAGFD_IOC_MAGIC, 5, uint32_t)
+#define TAGFD_IOC_UNSUBSCRIBE _IOW(TAGFD_IOC_MAGIC, 6, uint32_t)
+
+// On /dev/tagfd.bulk: read or write many tags in one call. Entries are 
+// processed in order. Returns the number of entries processed, which is 
+// less than count only if the call was interrupted part way through.
+#define TAGFD_IOC_BULKREAD    _IOW(TAGFD_IOC_MAGIC, 7, struct tag_bulk)
+#define TAGFD_IOC_BULKWRITE   _IOW(TAGFD_IOC_MAGIC, 8, struct tag_bulk)
+
+// On /dev/tagfd.bulk: find a tag's ID from its name. Fails with ENOENT if 
+// there is no such tag.
+#define TAGFD_IOC_LOOKUP      _IOWR(TAGFD_IOC_MAGIC, 9, struct tag_lookup)
+
+// On /dev/tagfd.tag: bind this file descriptor to a tag, by ID or by name 
+// (BINDNAME also fills in the ID). Once bound, the file descriptor behaves 
+// exactly like one opened from /dev/tagfd/. It can only be bound once.
+#define TAGFD_IOC_BIND        _IOW(TAGFD_IOC_MAGIC, 10, uint32_t)
+#define TAGFD_IOC_BINDNAME    _IOWR(TAGFD_IOC_MAGIC, 11, struct tag_lookup)
+
+// On a tag: set this file descriptor's change filter (see struct tag_filter).
+#define TAGFD_IOC_SETFILTER   _IOW(TAGFD_IOC_MAGIC, 12, struct tag_filter)
+
+// On a tag: put this file descriptor in queue mode, with room for the given 
+// number of values (at most TAGFD_QUEUE_MAX), or take it out of queue mode (0). 
+// In queue mode, every value written to the tag is queued, and read() returns
+// as many queued values as fit in the buffer, oldest first. If the queue is 
+// full, the oldest value is dropped and counted as an overflow. In extended 
+// mode, a gap in the generations shows where values were dropped. Change 
+// filters don't apply in queue mode. 
+#define TAGFD_IOC_SETQUEUE    _IOW(TAGFD_IOC_MAGIC, 13, uint32_t)
+#define TAGFD_QUEUE_MAX       65536
+
+// On a tag in queue mode, or on the journal: get the number of values 
+// dropped since the last time this was called (and reset it).
+#define TAGFD_IOC_GETOVERFLOW _IOR(TAGFD_IOC_MAGIC, 14, uint64_t)
+
+// On a tag: atomic read-modify-write operations, done under the tag's lock, 
+// so that several writers can share a tag (e.g. a counter) without racing.
+// See struct tag_cas and struct tag_fetchadd. Fail with the same errors as
+// write(), and FETCHADD fails with EINVAL if the tag isn't an integer.
+#define TAGFD_IOC_CAS         _IOWR(TAGFD_IOC_MAGIC, 15, struct tag_cas)
+#define TAGFD_IOC_FETCHADD    _IOWR(TAGFD_IOC_MAGIC, 16, struct tag_fetchadd)
+
+// On /dev/tagfd.bulk: write up to TAGFD_TX_MAX tags as a single transaction.
+// Either all of the writes are made or none are, and a snapshot (below) 
+// never sees some of them without the others. Each tag can only appear 
+// once. If any entry would fail, nothing is written, the call fails with 
+// ECANCELED, and the statuses say why (entries that were fine get 
+// -ECANCELED). Otherwise each entry's tag is filled in as stored.
+#define TAGFD_IOC_TXWRITE     _IOW(TAGFD_IOC_MAGIC, 17, struct tag_bulk)
+// (The module holds every tag's lock at once while committing, so this is
+// kept well inside lockdep's limit on locks held at a time, which is 48.)
+#define TAGFD_TX_MAX          32
+
+// On /dev/tagfd.bulk: read many tags, consistently with respect to 
+// transactions. Unlike TAGFD_IOC_BULKREAD, the result is all or nothing:
+// it returns 0 on success, with every entry's status and tag filled in.
+#define TAGFD_IOC_SNAPSHOT    _IOW(TAGFD_IOC_MAGIC, 18, struct tag_bulk)
+
+// On a tag: get its period in nanoseconds if it's a timer tag (see struct 
+// tag_timer_config), or 0 if it isn't.
+#define TAGFD_IOC_GETPERIOD   _IOR(TAGFD_IOC_MAGIC, 19, uint64_t)
+
+// On a tag: put this file descriptor in aggregate mode (nonzero), or take it
+// out (0). In aggregate mode, read() returns a struct tag_aggregate (the 
+// buffer must be big enough for one), and otherwise behaves as usual, 
+// filters included. A file descriptor can't be in queue mode and aggregate
+// mode at the same time (EBUSY). 
+#define TAGFD_IOC_SETAGGREGATE _IOW(TAGFD_IOC_MAGIC, 20, uint32_t)
+
+// On a tag: read() and poll() in one call (see struct tag_waitread). Fails 
+// with ETIMEDOUT if there's no new value in time, EINTR if interrupted by a
+// signal, and EBUSY in queue or aggregate mode. 
+#define TAGFD_IOC_WAITREAD    _IOWR(TAGFD_IOC_MAGIC, 21, struct tag_waitread)
+
+// On a tag: get the size of its array in bytes (see TAGFD_ACTION_ARRAY), 
+// or 0 if it isn't an array tag. 
+#define TAGFD_IOC_ARRAYSIZE   _IOR(TAGFD_IOC_MAGIC, 22, uint32_t)
+
+// File descriptor flags
+#define TAGFD_FLAG_EXTENDED   0x0001  // read() and write() exchange tagx_t
+#define TAGFD_FLAG_KERNELTIME 0x0002  // the module timestamps writes (see below)
+#define TAGFD_FLAGS_ALL       (TAGFD_FLAG_EXTENDED | TAGFD_FLAG_KERNELTIME)
+
+// With TAGFD_FLAG_KERNELTIME, the timestamps in the tags written are ignored:
+// the module stamps each write with the time it was made (CLOCK_REALTIME, at
+// full resolution), but never earlier than the tag's current timestamp. So 
+// the writer doesn't need to read the clock, and its writes are never 
+// rejected for going back in time, even if the clock is stepped backwards 
+// (the tag's timestamp just holds still until the clock catches up). This 
+// works for write(), the atomic operations, and bulk writes and transactions
+// (as a flag in struct tag_bulk).
+
 #endif
@@ -116,4 +116,248 @@ bool tag_fromStr_partial(const char * encoded, uint8_t dtype, tag_t * output);
 
 
 
+// ============================================================================
+//  Shared tag table
+// ============================================================================
+
+/*  The tagfd module keeps a copy of every tag's current value in a table that 
+    can be mapped into a process's memory (/dev/tagfd.table). Reading a tag 
+    through the table doesn't need a system call, and doesn't count as a read
+    of the tag: poll() and read() on the tag's own file descriptor are not 
+    affected. If you want to be woken up when a tag changes, you still need 
+    its file descriptor. 
+    
+    Tags are identified in the table by their ID. getTagId returns the ID of
+    the tag open on the given file descriptor, or -1 on failure (errno set).
+    
+    tagTableOpen maps the table, returning NULL on failure (errno set). 
+    tagTableClose unmaps it. 
+    
+    tagTableRead copies a consistent snapshot of the tag with the given ID into
+    *output. It returns false if there is no such tag. tagTableReadExtended
+    does the same, but also provides the generation and full resolution 
+    timestamp. */
+typedef struct tag_table tag_table_t;
+
+int           getTagId      (int fd);
+tag_table_t * tagTableOpen  (void);
+void          tagTableClose (tag_table_t * table);
+bool          tagTableRead  (tag_table_t * table, int id, tag_t * output);
+bool          tagTableReadExtended (tag_table_t * table, int id, tagx_t * output);
+
+/*  Sets the flags (TAGFD_FLAG_*) of a tag file descriptor. For example, 
+    setting TAGFD_FLAG_EXTENDED makes read() and write() on that descriptor
+    exchange tagx_t rather than tag_t. Returns false on failure (errno set). */
+bool          setTagFlags   (int fd, uint32_t flags);
+
+/*  Sets the change filter of a tag file descriptor (see struct tag_filter in
+    tagfd-shared.h). read() and poll() on that descriptor will then only 
+    report changes that are big enough (deadband) or far enough apart in 
+    time (minimum interval). Pass a zeroed filter to remove it. Returns 
+    false on failure (errno set). */
+bool          setTagFilter  (int fd, const struct tag_filter * filter);
+
+/*  Puts a tag file descriptor in queue mode, with room for depth values 
+    (0 turns queue mode off). read() on that descriptor then returns every 
+    value written, oldest first, as many as fit in the buffer. Returns 
+    false on failure (errno set). */
+bool          setTagQueue   (int fd, uint32_t depth);
+
+/*  Gets the number of values dropped from a tag's queue (because it was 
+    full) since the last call. Returns false on failure (errno set). */
+bool          getTagOverflow(int fd, uint64_t * overflow);
+
+/*  Turns aggregate mode on or off on a tag file descriptor. read() on that 
+    descriptor then returns a struct tag_aggregate: the latest value, and 
+    statistics of the values written since the previous read. Returns false 
+    on failure (errno set). */
+bool          setTagAggregate(int fd, bool on);
+
+/*  Waits up to timeout_ns (TAGFD_WAIT_FOREVER: no limit) for a new value of 
+    a tag, and reads it, in one system call: the same as poll() then read(),
+    for a program that waits on a single tag. Returns false on failure (errno
+    set, ETIMEDOUT if there was no new value in time). */
+bool          waitReadTag   (int fd, uint64_t timeout_ns, tagx_t * tag);
+
+/*  Gets the period of a timer tag, in nanoseconds (see struct 
+    tag_timer_config in tagfd-shared.h). The period is 0 if the tag isn't a
+    timer tag. Returns false on failure (errno set). */
+bool          getTagPeriod  (int fd, uint64_t * period_ns);
+
+/*  Atomic compare-and-swap and fetch-add on a tag file descriptor (see 
+    struct tag_cas and struct tag_fetchadd in tagfd-shared.h). Each is a 
+    single system call, done under the tag's lock. casTag returns true if the
+    call succeeded, whether or not the swap happened (see cas->swapped). 
+    Both return false on failure (errno set). */
+bool          casTag        (int fd, struct tag_cas * cas);
+bool          fetchAddTag   (int fd, struct tag_fetchadd * add);
+
+
+
+// ============================================================================
+//  Opening tags
+// ============================================================================
+
+/*  Opens a tag by name (e.g. "timer.1sec"), with the given open() flags. 
+    This opens /dev/tagfd/<name> if it exists. Otherwise (for instance when
+    the module was loaded with nodev=1) it opens /dev/tagfd.tag and binds it
+    to the tag. Either way, the file descriptor behaves the same. Returns 
+    the file descriptor, or -1 on failure (errno set). */
+int           openTag       (const char * name, int flags);
+
+/*  Lists every tag, with its ID, name and current value, by reading 
+    /proc/tagfd/tags in one go (rather than walking /dev/tagfd, which also 
+    misses tags when the module was loaded with nodev=1). The callback is
+    called once per tag, in ID order, with callbackParam as its first 
+    argument. If filter isn't NULL, only tags whose names start with it are
+    passed to the callback. If the callback returns anything but zero, the 
+    listing stops there. 
+    
+    Returns 0 on success, 1 if the callback stopped it, or -1 on failure 
+    (errno set). */
+int           listTags      (const char * filter, void * callbackParam,
+                             int (*callback) (void * param, int id, const char * name, const tagx_t * tag));
+
+
+
+// ============================================================================
+//  Subscriptions
+// ============================================================================
+
+/*  A subscription (/dev/tagfd.sub) is a single file descriptor that reports
+    changes to any number of tags. Each read() returns a batch of 
+    struct tag_record (see tagfd-shared.h), one per tag that has changed since
+    it was last reported, and poll() reports POLLIN while changes are pending.
+    A tag is reported once as soon as it is subscribed to. 
+    
+    openSubscription opens a new (empty) subscription, returning a file 
+    descriptor, or -1 on failure (errno set). subscribeTag and unsubscribeTag
+    add and remove tags (by ID, see getTagId), returning false on failure 
+    (errno set). */
+int           openSubscription (void);
+bool          subscribeTag     (int fd, int id);
+bool          unsubscribeTag   (int fd, int id);
+
+/*  /dev/tagfd.journal reports every write to any tag, in the order they were
+    made. Each read() returns a batch of struct tag_journal_entry (see 
+    tagfd-shared.h), starting from the first write after the journal was 
+    opened. A gap in the sequence numbers means changes were lost because the
+    reader fell behind; getTagOverflow on the journal gets how many. 
+    
+    openJournal returns a file descriptor, or -1 on failure (errno set). */
+int           openJournal      (void);
+
+
+
+// ============================================================================
+//  Bulk reads and writes
+// ============================================================================
+
+/*  /dev/tagfd.bulk reads or writes an array of tags (by ID) in one system call.
+    openBulk opens it, returning a file descriptor, or -1 on failure (errno set).
+    
+    bulkReadTags and bulkWriteTags process all count entries of the array, 
+    filling in each entry's status (0, or a negative errno value, see 
+    struct tag_bulk_entry in tagfd-shared.h). For reads, the tag is filled in
+    too. For writes, flags can be TAGFD_FLAG_EXTENDED, to use the entries' 
+    timestamp_ns rather than tag.timestamp. They return false if the call 
+    itself failed (errno set), in which case the statuses are not valid. */
+int           openBulk      (void);
+
+/*  Finds the ID of the tag with the given name (e.g. "timer.1sec"), using the 
+    bulk device. Returns -1 on failure (errno set, ENOENT if there is no such 
+    tag). */
+int           lookupTagId   (int fd, const char * name);
+bool          bulkReadTags  (int fd, struct tag_bulk_entry * entries, size_t count);
+bool          bulkWriteTags (int fd, struct tag_bulk_entry * entries, size_t count, uint32_t flags);
+
+/*  Transactions, also through the bulk device. txWriteTags writes up to 
+    TAGFD_TX_MAX tags (each at most once) atomically: either all of the 
+    writes are made, or none are, in which case it returns false with errno
+    set to ECANCELED, and the statuses say which entries were the problem. 
+    snapshotTags reads any number of tags such that no transaction is seen 
+    half done. Both return false on failure (errno set). */
+bool          txWriteTags   (int fd, struct tag_bulk_entry * entries, size_t count, uint32_t flags);
+bool          snapshotTags  (int fd, struct tag_bulk_entry * entries, size_t count);
+
+
+
+// ============================================================================
+//  Tag rings (io_uring)
+// ============================================================================
+
+/*  A tag ring watches many tags with a handful of system calls, using io_uring:
+    it keeps a read queued on each tag file descriptor, and reports the reads 
+    as they complete, queuing the next one. It's an alternative to poll() 
+    (or a subscription) when thousands of tags are watched. 
+    
+    openTagRing queues a read on each of the count file descriptors (which 
+    must stay open, and fds must stay valid, until the ring is closed). Reads
+    honour each descriptor's flags, filter and queue mode, one value at a 
+    time (aggregate mode isn't supported). Returns NULL on failure (errno 
+    set, ENOSYS if the kernel doesn't have io_uring). 
+    
+    waitTagRing waits for at least one read to complete and fills in up to 
+    max events, returning how many, or -1 on failure (errno set). An event's
+    result is what read() would have returned: the number of bytes read into
+    tag (sizeof(tag_t) or sizeof(tagx_t), depending on the descriptor's 
+    flags), or a negative errno value (e.g. -EIDRM if the tag was deleted), 
+    after which the tag isn't read again. 
+    
+    closeTagRing cancels the reads in flight and frees the ring. */
+struct tag_ring;
+struct tag_ring_event
+{
+    size_t  index;   // into the fds array given to openTagRing
+    int     result;
+    tagx_t  tag;
+};
+
+// The submission queue's size (reads are submitted in batches of up to this many).
+#define TAG_RING_MAX_SUBMIT 4096
+
+struct tag_ring * openTagRing  (const int * fds, size_t count);
+int               waitTagRing  (struct tag_ring * ring, struct tag_ring_event * events, int max);
+void              closeTagRing (struct tag_ring * ring);
+
+
+
+// ============================================================================
+//  Array tags
+// ============================================================================
+
+/*  Array tags (see TAGFD_ACTION_ARRAY in tagfd-shared.h) hold a whole array 
+    of numbers, e.g. a waveform, which is always read and written as one. 
+    
+    getTagArraySize gets the size of an array tag's elements, in bytes (0 if 
+    it isn't an array tag). Returns false on failure (errno set). 
+    tagArrayElementSize gives the size of one element of an array of the 
+    given data type, or 0 if arrays can't have that type (strings). 
+    
+    readTagArray and writeTagArray read or write an array tag along with its
+    elements (size bytes at data, which must be the whole array) in one 
+    system call. flags must be the descriptor's (see setTagFlags): in 
+    extended mode (TAGFD_FLAG_EXTENDED) the whole tagx_t is exchanged, 
+    otherwise only tag->tag is. 
+    readTagArray blocks just like read(). Both return false on failure 
+    (errno set). 
+    
+    tagArrayMap maps an array tag (read-only, see struct tag_array_shm), so 
+    that it can be read without a system call, like the shared table. It 
+    returns NULL on failure (errno set, ENODEV if it isn't an array tag). 
+    tagArrayRead copies a consistent snapshot of the tag into *tag, and of 
+    its elements into data (which must have room for all of them). It 
+    returns false if the tag has been deleted. tagArrayUnmap unmaps it. */
+typedef struct tag_array_map tag_array_map_t;
+
+bool              getTagArraySize (int fd, uint32_t * size);
+size_t            tagArrayElementSize(uint8_t dtype);
+bool              readTagArray    (int fd, tagx_t * tag, void * data, size_t size, uint32_t flags);
+bool              writeTagArray   (int fd, const tagx_t * tag, const void * data, size_t size, uint32_t flags);
+tag_array_map_t * tagArrayMap     (int fd);
+bool              tagArrayRead    (tag_array_map_t * map, tagx_t * tag, void * data);
+void              tagArrayUnmap   (tag_array_map_t * map);
+
+
+
 #endif
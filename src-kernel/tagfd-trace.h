@@ -0,0 +1,84 @@
+/*	Copyright (C) 2018, 2020 Harris M. Snyder
+
+	This file is part of Tagfd.
+
+	Tagfd is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Tagfd is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Tagfd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Tracepoints for the tagfd module. They show up as tagfd:tagfd_write,
+// tagfd:tagfd_wake and tagfd:tagfd_read, e.g. for perf record -e 'tagfd:*'.
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tagfd
+
+#if !defined(_TAGFD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TAGFD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// A write to a tag, accepted (err 0) or rejected (negative errno value).
+TRACE_EVENT(tagfd_write,
+	TP_PROTO(int id, u64 generation, int err),
+	TP_ARGS(id, generation, err),
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u64, generation)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->generation = generation;
+		__entry->err = err;
+	),
+	TP_printk("id=%d generation=%llu err=%d", __entry->id, __entry->generation, __entry->err)
+);
+
+// A writer waking the readers waiting on a tag.
+TRACE_EVENT(tagfd_wake,
+	TP_PROTO(int id, u64 generation),
+	TP_ARGS(id, generation),
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u64, generation)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->generation = generation;
+	),
+	TP_printk("id=%d generation=%llu", __entry->id, __entry->generation)
+);
+
+// A read() of a tag returning a value.
+TRACE_EVENT(tagfd_read,
+	TP_PROTO(int id, u64 generation),
+	TP_ARGS(id, generation),
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u64, generation)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->generation = generation;
+	),
+	TP_printk("id=%d generation=%llu", __entry->id, __entry->generation)
+);
+
+#endif /* _TAGFD_TRACE_H */
+
+// This part must be outside the include guard.
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tagfd-trace
+#include <trace/define_trace.h>
@@ -37,29 +37,86 @@
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
 #include <linux/time.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/wait.h>
 #include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/jhash.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
+#include <linux/sort.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/overflow.h>
+#include <linux/uio.h>
 
 
 #include "../include/tagfd-shared.h"
 
+#define CREATE_TRACE_POINTS
+#include "tagfd-trace.h"
+
 #define NAME "tagfd"
 #define MASTERNAME "tagfd.master"
+#define TABLENAME "tagfd.table"
+#define SUBNAME "tagfd.sub"
+#define BULKNAME "tagfd.bulk"
+#define BINDNAME "tagfd.tag"
+#define JOURNALNAME "tagfd.journal"
 #define PREFIX "tagfd!"
 
+// Minor numbers of the system devices. Tags get the minor numbers after these.
+#define MINOR_MASTER 0
+#define MINOR_TABLE  1
+#define MINOR_SUB    2
+#define MINOR_BULK   3
+#define MINOR_BIND   4
+#define MINOR_JOURNAL 5
+#define NSYSDEVS     6
+
 // -----------------------------------------
 // Module parameter(s)
 // -----------------------------------------
 
 
-// These parameters will appear in /sys/module/tagfd/parameters/, but are read-only there.
+// These parameters will appear in /sys/module/tagfd/parameters/.
 // They can be set when the module is loaded, as a command line args to insmod.
-// If we wanted to make values changeable at runtime (and we wanted to know about it) through sysfs,
-// we could do what is shown here: https://stackoverflow.com/questions/34957016/signal-on-kernel-parameter-change
 
-// This parameter stores the number of data tags that the system will allocate. 
+// This parameter stores the maximum number of data tags that the system will allow. 
+// Memory is only allocated for tags that are actually created. It can be changed at runtime
+// (by root, through sysfs), but not beyond TAGFD_TAGS_LIMIT or below the number of existing tags.
 static int max_tags = 64;
-module_param(max_tags, int, 0444 );
+
+static int tagfd_setMaxTags(const char * val, const struct kernel_param * kp);
+
+static const struct kernel_param_ops tagfd_maxTagsOps = {
+	.set = tagfd_setMaxTags,
+	.get = param_get_int,
+};
+module_param_cb(max_tags, &tagfd_maxTagsOps, &max_tags, 0644);
+
+// If set, tags don't get their own device files in /dev/tagfd/. They can only be opened
+// through /dev/tagfd.tag (see TAGFD_IOC_BIND). This saves a cdev, a device and its sysfs
+// entries per tag, which adds up when there are a lot of tags. 
+static bool nodev = false;
+module_param(nodev, bool, 0444);
+
+// The number of changes the journal (/dev/tagfd.journal) can hold, rounded up to a power of two.
+// Readers that fall further behind than this lose changes. 
+static int journal_size = 4096;
+module_param(journal_size, int, 0444);
+
+// If set, writes and reads are timed, for the latency histograms in /proc/tagfd/stats. 
+// Off by default, since it costs a few clock reads per write. 
+static bool stats_timing = false;
+module_param(stats_timing, bool, 0644);
 
 
 
@@ -68,34 +125,217 @@ module_param(max_tags, int, 0444 );
 // Module types and globals
 // -----------------------------------------
 
+// Rejected writes are counted by reason.
+#define STAT_REJECT_PERM  0 // -EPERM: wrong data type
+#define STAT_REJECT_INVAL 1 // -EINVAL: timestamp went backwards
+#define STAT_REJECT_OTHER 2
+#define STAT_NREJECT      3
+
+// Per-tag counters, for /proc/tagfd/stats. writes and rejected are protected by the 
+// tag's lock, the others are updated without it.
+struct tag_stats
+{
+	u64               writes;
+	u64               rejected[STAT_NREJECT];
+	atomic64_t        reads;    // values returned by read() on the tag
+	atomic64_t        wakeups;  // writes that had readers waiting to be woken
+	atomic_t          watchers; // open file descriptors bound to the tag
+};
+
 struct tag_ctx
 {
 	tag_t             tag;
-	struct mutex      mtx;
-	struct cdev       cdev;
+	u64               generation;   // incremented on every write
+	u64               timestamp_ns; // full resolution version of tag.timestamp
+	spinlock_t        lock;         // serializes writers
+	seqcount_t        seq;          // lets readers see tag, generation and timestamp_ns consistently
+	struct cdev     * cdev;         // a new one for each tag in the slot (see tagfd_construct_tag)
 	char              name[TAG_NAME_LENGTH];
 	wait_queue_head_t wqh;
+	int               id;
+	struct tag_shm_entry * shm; // this tag's entry in the shared table
+	struct list_head  subs;         // subscriptions to this tag (struct tag_sub), protected by lock
+	struct list_head  queues;       // watchers in queue mode (struct tag_watcher), protected by lock
+	struct list_head  aggs;         // watchers in aggregate mode (struct tag_watcher), protected by lock
+	struct hlist_node nameNode;     // in gl_nameIndex
+	u32               nameHash;
+	struct tag_stats  stats;
+	u64               commitNs;     // ktime_get_ns() at the last write, while stats_timing is set
+	struct tag_timer * timer;       // NULL unless this is a timer tag
+	struct tag_array_shm * array;   // NULL unless this is an array tag (vmalloc_user, so it can be mmap()ed)
+	u32               arrayBytes;   // the size of an array tag's elements (one copy), 0 for other tags
+	struct mutex      arrayMtx;     // serializes writers of an array tag's elements
+	bool              deleted;      // set with the lock held, see tagfd_masterDelete
+	struct list_head  deletedNode;  // in gl_deletedTags, from deletion until the slot is reused
+};
+
+// Timer tags count up by themselves. The hrtimer can't write the tag itself (tags' locks 
+// aren't irq-safe), so it records the tick and queues work to add it in process context.
+// Ticks that pile up before the work runs are added all at once, so none are lost. The 
+// write is stamped with the tick's time, but becomes visible after the workqueue's 
+// scheduling latency, which is the limit on timer tags' jitter.
+struct tag_timer
+{
+	struct tag_ctx     * e_ctx;
+	struct hrtimer       hrt;
+	struct work_struct   work;
+	u64                  period_ns;
+	atomic64_t           ticks;      // ticks not yet added to the tag
+};
+
+// Statistics of the values written to a tag since a watcher last read it (see struct tag_aggregate). 
+// min and max are kept in the tag's data type, along with their values as numbers (minN, maxN). 
+struct tag_agg
+{
+	u64                 updates;
+	u8                  dtype;     // of the values aggregated
+	bool                numeric;
+	tagvalue_t          min;
+	tagvalue_t          max;
+	s64                 minN;
+	s64                 maxN;
+	s64                 sum;
 };
 
 struct tag_watcher
 {
 	struct tag_ctx * e_ctx;
-	timestamp_t         ts_lastRead;
+	u64                 gen_lastRead;
+	u32                 flags;
+	
+	// Change filter (TAGFD_IOC_SETFILTER). Changes are reported relative to the last value read.
+	bool                filtered;
+	u64                 deadband;        // in the units of tagfd_numericValue, 0 for none
+	u32                 deadband_ppm;    // relative to the last value read, 0 for none
+	u64                 min_interval_ns; // 0 for none
+	tag_t               lastRead;
+	u64                 lastReadNs;      // when lastRead was read (ktime_get_ns)
+	spinlock_t          lastLock;        // serializes updates of gen_lastRead, lastRead and lastReadNs
+	seqcount_t          lastSeq;         // lets tagfd_watcherWake see them consistently
+	struct hrtimer      timer;           // wakes waiters once min_interval_ns has passed
+	
+	// Queue mode (TAGFD_IOC_SETQUEUE): every value written is kept, in a ring, until it's read. 
+	// The ring is indexed by absolute counts (modulo the depth), and protected by qlock. 
+	// Lock order: tag lock, then qlock.
+	struct list_head    queueNode;       // in e_ctx->queues, while in queue mode
+	spinlock_t          qlock;
+	tagx_t            * ring;            // NULL when not in queue mode
+	u32                 depth;
+	u64                 qhead;           // number of values ever queued
+	u64                 qtail;           // number of values read or dropped
+	u64                 overflow;        // values dropped because the ring was full
+	u64                 qepoch;          // bumped whenever the ring is replaced or removed
+	
+	// Aggregate mode (TAGFD_IOC_SETAGGREGATE): writers keep agg up to date, and read() takes 
+	// it and starts it over. Protected by the tag's lock. 
+	struct list_head    aggNode;         // in e_ctx->aggs, while in aggregate mode
+	bool                aggregate;
+	struct tag_agg      agg;
+};
+
+// An open /dev/tagfd.sub file. 
+// Lock order: subscriber mtx, then tag lock, then subscriber lock.
+struct tag_subscriber
+{
+	struct mutex      mtx;   // protects subs, and serializes readers
+	spinlock_t        lock;  // protects ready
+	struct list_head  subs;  // all of our subscriptions
+	struct list_head  ready; // subscriptions with an unreported change
+	wait_queue_head_t wqh;
+};
+
+// One tag in a subscriber's set.
+struct tag_sub
+{
+	struct tag_subscriber * owner;
+	struct tag_ctx        * e_ctx;
+	struct list_head        tagNode;   // in e_ctx->subs
+	struct list_head        ownerNode; // in owner->subs
+	struct list_head        readyNode; // in owner->ready while a change is pending, otherwise empty
 };
 
 static dev_t gl_dev; // First device number. 
 static struct class * gl_tagfdClass = NULL;
 
-static int gl_nEntities = 0;
+static int gl_nEntities = 0; // IDs handed out so far (deleted tags' included)
+static int gl_nTags = 0;     // tags that exist, which is what max_tags limits
+
+// Deleted tags. Their slots (tag_ctx, ID, minor number and table entry) are given to new 
+// tags once nothing refers to them any more, see tagfd_allocTag. gl_deletedSync is set 
+// when a tag has been deleted since the last RCU grace period. Protected by gl_tagsMtx.
+static LIST_HEAD(gl_deletedTags);
+static bool gl_deletedSync = false;
+
+// Our tags, indexed by ID. This is a two level array, so that it can grow without moving 
+// tags around: the directory is fixed size, and chunks of tag pointers are allocated as needed.
+#define TAG_CHUNK_SIZE  (PAGE_SIZE / sizeof(struct tag_ctx *))
+#define TAG_NCHUNKS     DIV_ROUND_UP(TAGFD_TAGS_LIMIT, TAG_CHUNK_SIZE)
+static struct tag_ctx ** gl_tagChunks[TAG_NCHUNKS];
+
+// Serializes tag creation and deletion, and changes to max_tags.
+static DEFINE_MUTEX(gl_tagsMtx);
+
+// Index of the tags by name (without the PREFIX). Only the master device changes it; 
+// lookups are done under rcu_read_lock. 
+#define NAME_HASH_BITS 14
+static DEFINE_HASHTABLE(gl_nameIndex, NAME_HASH_BITS);
+
+// The shared tag table (mmap-able through the table device), one entry per tag. 
+// Pages are allocated as they're needed, either by a new tag or by a page fault.
+#define TABLE_ENTRIES_PER_PAGE  (PAGE_SIZE / sizeof(struct tag_shm_entry))
+#define TABLE_NPAGES            DIV_ROUND_UP(TAGFD_TAGS_LIMIT, TABLE_ENTRIES_PER_PAGE)
+static struct tag_shm_entry * gl_tablePages[TABLE_NPAGES];
+
+// The journal: a ring of the last journal_size changes to any tag, in the order they were made. 
+// gl_journalHead is the sequence number of the next change, and the ring is indexed by it. 
+// Writers append to it with their tag's lock held (lock order: tag lock, then journal lock), 
+// but only while someone has the journal device open. 
+static struct tag_journal_entry * gl_journal;
+static u64                        gl_journalHead;
+static DEFINE_SPINLOCK(gl_journalLock);
+static DECLARE_WAIT_QUEUE_HEAD(gl_journalWqh);
+static atomic_t                   gl_journalReaders = ATOMIC_INIT(0);
+
+// Transactions (writes to several tags at once, see TAGFD_IOC_TXWRITE) are serialized by
+// gl_txMtx, which lets a transaction hold the locks of all of its tags at the same time. 
+// gl_txSeq is bumped around each commit, so that snapshots can tell if they overlapped one.
+static DEFINE_MUTEX(gl_txMtx);
+static seqcount_t gl_txSeq = SEQCNT_ZERO(gl_txSeq);
+
+// Latency histograms for /proc/tagfd/stats, kept per CPU while stats_timing is set. 
+// Bucket n counts times from 2^n to 2^(n+1) nanoseconds.
+#define HIST_BUCKETS 32
+struct tagfd_hists
+{
+	u64 lockWait[HIST_BUCKETS];    // writers waiting for a tag's lock
+	u64 lockHold[HIST_BUCKETS];    // writers holding a tag's lock
+	u64 wakeLatency[HIST_BUCKETS]; // from a write to a reader that was waiting for it returning it
+};
+static DEFINE_PER_CPU(struct tagfd_hists, gl_hists);
 
-static struct tag_ctx  * gl_tags = NULL; // Our list of tags.
+static struct proc_dir_entry * gl_procDir;
 
 // The master device (used for configuration) - can be written to by only one process at a time.
 static atomic_t          gl_masterAvailable  = ATOMIC_INIT(1);
-static struct cdev       gl_masterCdev;
-static int               gl_masterStatus = 0;
 
-static char  gl_configBuffer[sizeof(struct tag_config)];
+// The system devices (master, table, sub, bulk, tag, journal), which live at the start of our minor number range.
+struct tagfd_sysdev
+{
+	const char                    * name;
+	umode_t                         mode;
+	const struct file_operations  * fops;
+	struct cdev                     cdev;
+	int                             status;
+};
+
+// Big enough for any request to the master device (see tagfd_masterParse). 
+union tagfd_request
+{
+	struct tag_config       config;
+	struct tag_timer_config timer;
+	struct tag_array_config array;
+};
+static char  gl_configBuffer[sizeof(union tagfd_request)];
 static char  gl_newNameBuffer[sizeof(struct tag_config) + 100];
 static const char * validTagNameChars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_";
 
@@ -103,413 +343,3225 @@ static const char * validTagNameChars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLM
 // Misc functions. 
 // -----------------------------------------
 
-// This function is used by our device class to set the permissions of the devices that it creates. 
-static char *
-tagfd_devnode(struct device *dev, umode_t *mode)
+// Copies the tag's current value into its shared table entry. 
+// Must be called with the tag's lock held (that's what serializes us against other writers).
+static void
+tagfd_publish(struct tag_ctx * ectx)
 {
-	if(!mode) return NULL;
-    if(dev->devt == MKDEV(MAJOR(gl_dev), 0))
-	{
-		*mode = 0200;
-	}
-	else
-	{
-		*mode = 0666;
-	}
+	struct tag_shm_entry * e = ectx->shm;
+	
+	WRITE_ONCE(e->sequence, e->sequence + 1);
+	smp_wmb();
+	memcpy(&e->tag, &ectx->tag, sizeof(tag_t));
+	e->generation = ectx->generation;
+	e->timestamp_ns = ectx->timestamp_ns;
+	smp_wmb();
+	WRITE_ONCE(e->sequence, e->sequence + 1);
+}
+
+// Copies the tag into an array tag's shared memory, and if flip is set, makes the other
+// copy of the elements (just filled in by tagfd_writeArray) the active one. Call with the 
+// tag's lock held, and inside its write_seqcount section when flipping, so that 
+// tagfd_arrayRead sees the elements and the tag consistently. 
+static void
+tagfd_arrayPublish(struct tag_ctx * ectx, bool flip)
+{
+	struct tag_shm_entry * e = &ectx->array->entry;
 	
-    return NULL;
+	WRITE_ONCE(e->sequence, e->sequence + 1);
+	smp_wmb();
+	if(flip)
+		WRITE_ONCE(ectx->array->active, !ectx->array->active);
+	memcpy(&e->tag, &ectx->tag, sizeof(tag_t));
+	e->generation = ectx->generation;
+	e->timestamp_ns = ectx->timestamp_ns;
+	smp_wmb();
+	WRITE_ONCE(e->sequence, e->sequence + 1);
 }
 
+// Fills in an extended tag from the tag's context. Call with the tag's lock held, 
+// or use tagfd_readTag.
+static void
+tagfd_snapshot(struct tag_ctx * ectx, tagx_t * out)
+{
+	out->tag = ectx->tag;
+	out->generation = ectx->generation;
+	out->timestamp_ns = ectx->timestamp_ns;
+}
 
-static int 
-tagfd_isNameTaken(const char * name, size_t namelen)
+// Takes a consistent snapshot of a tag without locking. 
+static void
+tagfd_readTag(struct tag_ctx * ectx, tagx_t * out)
 {
-	int i ;
+	unsigned int seq;
 	
-	if(namelen > TAG_STRING_VALUE_LENGTH) namelen = TAG_STRING_VALUE_LENGTH;
+	do
+	{
+		seq = read_seqcount_begin(&ectx->seq);
+		tagfd_snapshot(ectx, out);
+	}
+	while(read_seqcount_retry(&ectx->seq, seq));
+}
+
+// Copies an array tag out to userspace, consistently and without locking: the first 
+// hdrLen bytes of the tag (see tagfd_recordSize), then its elements. Leaves the tag in *out. 
+// Returns 0, or -EFAULT (with the iterator where it started). 
+static int
+tagfd_arrayRead(struct tag_ctx * ectx, tagx_t * out, size_t hdrLen, struct iov_iter * to)
+{
+	unsigned int seq;
+	const void * elements;
+	size_t n;
 	
-	for(i = 0 ; i < gl_nEntities; i++)
+	for(;;)
 	{
-		if (0 == strncmp(gl_tags[i].name, name, namelen))
+		seq = read_seqcount_begin(&ectx->seq);
+		tagfd_snapshot(ectx, out);
+		elements = TAG_ARRAY_ELEMENTS(ectx->array, READ_ONCE(ectx->array->active));
+		n = copy_to_iter(out, hdrLen, to);
+		if(n == hdrLen)
+			n += copy_to_iter(elements, ectx->arrayBytes, to);
+		if(n != hdrLen + ectx->arrayBytes)
 		{
-			return 1;
+			iov_iter_revert(to, n);
+			return -EFAULT;
 		}
+		if(!read_seqcount_retry(&ectx->seq, seq))
+			return 0;
+		
+		// a writer got in the way, so copy it all again
+		iov_iter_revert(to, hdrLen + ectx->arrayBytes);
 	}
-	return 0;
 }
 
+// The size of the structure exchanged by read() and write() on this file descriptor. 
+static inline size_t
+tagfd_recordSize(struct tag_watcher * watcher)
+{
+	return (watcher->flags & TAGFD_FLAG_EXTENDED) ? sizeof(tagx_t) : sizeof(tag_t);
+}
 
+static inline int
+tagfd_tagMinor(int id)
+{
+	return id + NSYSDEVS;
+}
 
-// -----------------------------------------
-// tag_ctx file ops
-// -----------------------------------------
+// The tag with the given ID, even if it has been deleted. Returns NULL if there never was one.
+// Pairs with the smp_store_release in tagfd_masterCreate, so the tag is fully constructed.
+static struct tag_ctx *
+tagfd_tagSlot(u32 id)
+{
+	int n = smp_load_acquire(&gl_nEntities);
+	
+	if(id >= (u32)n)
+		return NULL;
+	return gl_tagChunks[id / TAG_CHUNK_SIZE][id % TAG_CHUNK_SIZE];
+}
 
+// Look up a tag by ID. Returns NULL if there is no such tag (or it has been deleted).
+static struct tag_ctx *
+tagfd_getTag(u32 id)
+{
+	struct tag_ctx * ectx = tagfd_tagSlot(id);
+	
+	if(ectx == NULL || READ_ONCE(ectx->deleted))
+		return NULL;
+	return ectx;
+}
 
-static int 
-tagfd_open(struct inode * inode, struct file * filp)
+// Returns the given page of the shared table, allocating it if necessary. 
+// Returns NULL if we're out of memory.
+static struct tag_shm_entry *
+tagfd_tablePage(unsigned long idx)
 {
+	struct tag_shm_entry * page = READ_ONCE(gl_tablePages[idx]);
 	
-	struct tag_watcher * watcher = kmalloc(sizeof(struct tag_watcher), GFP_KERNEL);
-	if(watcher == NULL)
+	if(page)
+		return page;
+	
+	// A zeroed page leaves every entry at DT_INVALID. 
+	page = (struct tag_shm_entry *) get_zeroed_page(GFP_KERNEL);
+	if(page == NULL)
+		return NULL;
+	
+	// we can race with a page fault here, so the first one to get there wins.
+	if(cmpxchg(&gl_tablePages[idx], NULL, page) != NULL)
 	{
-		return -ENOMEM;
+		free_page((unsigned long)page);
+		page = READ_ONCE(gl_tablePages[idx]);
 	}
+	return page;
+}
+
+// Setter for the max_tags module parameter. 
+static int
+tagfd_setMaxTags(const char * val, const struct kernel_param * kp)
+{
+	int n, err;
 	
-	watcher->ts_lastRead = 0;
-	watcher->e_ctx = container_of(inode->i_cdev, struct tag_ctx, cdev);
+	err = kstrtoint(val, 0, &n);
+	if(err)
+		return err;
+	if(n < 1 || n > TAGFD_TAGS_LIMIT)
+		return -EINVAL;
 	
-	filp->private_data = watcher;
+	// can't shrink below the IDs in use (which may include deleted tags', that are still open).
+	mutex_lock(&gl_tagsMtx);
+	if(n < gl_nEntities)
+		err = -EBUSY;
+	else
+		WRITE_ONCE(max_tags, n);
+	mutex_unlock(&gl_tagsMtx);
 	
-	return 0;
+	return err;
 }
 
-static int
-tagfd_release(struct inode * inode, struct file * filp)
+// Queue a subscription for reporting (if it isn't already) and wake its owner.
+static void
+tagfd_subNotify(struct tag_sub * sub)
 {
-	kfree(filp->private_data);
-	return 0;
+	struct tag_subscriber * subr = sub->owner;
+	
+	spin_lock(&subr->lock);
+	if(list_empty(&sub->readyNode))
+		list_add_tail(&sub->readyNode, &subr->ready);
+	spin_unlock(&subr->lock);
+	if(wq_has_sleeper(&subr->wqh))
+		wake_up_interruptible(&subr->wqh);
 }
 
+// Adds a change to the journal. Call with the tag's lock held. 
+static void
+tagfd_journalAppend(struct tag_ctx * ectx, const tagx_t * tag)
+{
+	struct tag_journal_entry * entry;
+	
+	spin_lock(&gl_journalLock);
+	entry = &gl_journal[gl_journalHead & (journal_size - 1)];
+	entry->seq = gl_journalHead;
+	entry->id = ectx->id;
+	entry->reserved = 0;
+	entry->tag = *tag;
+	gl_journalHead++;
+	spin_unlock(&gl_journalLock);
+}
 
-static ssize_t
-tagfd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+// The tag's name, as the user knows it (i.e. without the PREFIX).
+static inline const char *
+tagfd_tagName(struct tag_ctx * ectx)
 {
-	struct tag_watcher * watcher = filp->private_data;
+	return ectx->name + strlen(PREFIX);
+}
+
+// Finds a tag by name. Returns NULL if there is no such tag. 
+// Call under rcu_read_lock, or from the master device (the only thing that changes the index).
+static struct tag_ctx *
+tagfd_findByName(const char * name, size_t namelen)
+{
+	struct tag_ctx * ectx;
+	u32 key = jhash(name, namelen, 0);
 	
-	if(count < sizeof(tag_t))
+	hash_for_each_possible_rcu(gl_nameIndex, ectx, nameNode, key)
+	{
+		if(ectx->nameHash == key && 0 == strcmp(tagfd_tagName(ectx), name))
+			return ectx;
+	}
+	return NULL;
+}
+
+// Copies a name supplied by userspace (TAG_NAME_LENGTH bytes, null terminated). 
+// Returns 0, -EFAULT or -EINVAL.
+static int
+tagfd_copyUserName(char * name, const char __user * uname)
+{
+	if(copy_from_user(name, uname, TAG_NAME_LENGTH))
+		return -EFAULT;
+	if(name[TAG_NAME_LENGTH-1] != 0)
 		return -EINVAL;
-	
+	return 0;
+}
 
-	// acquire lock on mutex. 
-	if(mutex_lock_interruptible(&watcher->e_ctx->mtx))
-		return -ERESTARTSYS;
+// Finds a tag by a name supplied by userspace. Returns the tag, or an ERR_PTR.
+static struct tag_ctx *
+tagfd_findByUserName(const char __user * uname)
+{
+	char name[TAG_NAME_LENGTH];
+	struct tag_ctx * ectx;
+	int err;
 	
+	err = tagfd_copyUserName(name, uname);
+	if(err)
+		return ERR_PTR(err);
 	
-	// while no new value
-	while (watcher->ts_lastRead == watcher->e_ctx->tag.timestamp)
-	{ 
-		// release the lock.
-		mutex_unlock(&watcher->e_ctx->mtx);
-		
-		// if we're in non-blocking mode, don't block. 
-		if(filp->f_flags & O_NONBLOCK)
-			return -EAGAIN;
-		
-		// if we can block, do so. 
-		if(wait_event_interruptible(watcher->e_ctx->wqh, (watcher->ts_lastRead != watcher->e_ctx->tag.timestamp)))
-			return -ERESTARTSYS;
-		
-		// reaquire lock for while condition check.
-		if(mutex_lock_interruptible(&watcher->e_ctx->mtx))
-			return -ERESTARTSYS;
+	// Deleted tags are never freed, so the pointer is still good after we leave the read side.
+	// (If the tag is deleted and its slot reused meanwhile, the caller sees the new tag.)
+	rcu_read_lock();
+	ectx = tagfd_findByName(name, strlen(name));
+	rcu_read_unlock();
+	
+	return (ectx && !READ_ONCE(ectx->deleted)) ? ectx : ERR_PTR(-ENOENT);
+}
+
+
+
+// -----------------------------------------
+// Statistics
+// -----------------------------------------
+
+static inline int
+tagfd_histBucket(u64 ns)
+{
+	return ns ? min_t(int, ilog2(ns), HIST_BUCKETS - 1) : 0;
+}
+
+#define tagfd_histAdd(field, ns) this_cpu_inc(gl_hists.field[tagfd_histBucket(ns)])
+
+// Takes a tag's lock for a write, timing the wait if stats_timing is set. 
+// Returns when the lock was taken (0 if not timing), for tagfd_unlockWrite.
+static inline u64
+tagfd_lockWrite(struct tag_ctx * ectx)
+{
+	u64 start, now;
+	
+	if(!READ_ONCE(stats_timing))
+	{
+		spin_lock(&ectx->lock);
+		return 0;
 	}
 	
-	// ok, data is available. 
-	if(copy_to_user(buf, &watcher->e_ctx->tag ,sizeof(tag_t)))
+	start = ktime_get_ns();
+	spin_lock(&ectx->lock);
+	now = ktime_get_ns();
+	tagfd_histAdd(lockWait, now - start);
+	return now;
+}
+
+static inline void
+tagfd_unlockWrite(struct tag_ctx * ectx, u64 locked)
+{
+	if(locked)
+		tagfd_histAdd(lockHold, ktime_get_ns() - locked);
+	spin_unlock(&ectx->lock);
+}
+
+// Counts (and traces) a rejected write. Call with the tag's lock held.
+static void
+tagfd_rejectWrite(struct tag_ctx * ectx, int err)
+{
+	switch(err)
 	{
-		mutex_unlock(&watcher->e_ctx->mtx);
-		return -EFAULT;
+		case -EPERM:  ectx->stats.rejected[STAT_REJECT_PERM]++;  break;
+		case -EINVAL: ectx->stats.rejected[STAT_REJECT_INVAL]++; break;
+		default:      ectx->stats.rejected[STAT_REJECT_OTHER]++; break;
 	}
-	watcher->ts_lastRead = watcher->e_ctx->tag.timestamp;
+	trace_tagfd_write(ectx->id, ectx->generation, err);
+}
 
-	mutex_unlock(&watcher->e_ctx->mtx);
-	return sizeof(tag_t);
+// Counts (and traces) values read from a tag. waited says whether the reader 
+// had to wait for the value, in which case the wakeup latency is recorded.
+static void
+tagfd_countRead(struct tag_ctx * ectx, const tagx_t * tag, u32 n, bool waited)
+{
+	u64 committed = READ_ONCE(ectx->commitNs);
+	
+	atomic64_add(n, &ectx->stats.reads);
+	trace_tagfd_read(ectx->id, tag->generation);
+	if(waited && committed && READ_ONCE(stats_timing))
+		tagfd_histAdd(wakeLatency, ktime_get_ns() - committed);
 }
 
-static ssize_t
-tagfd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+
+
+
+// -----------------------------------------
+// Change filters (deadband and minimum interval)
+// -----------------------------------------
+
+// Number of fraction bits used when comparing real values. 
+#define REAL_FRAC_BITS 32
+
+// Converts an IEEE 754 value, given as its sign, unbiased exponent and mantissa (including the 
+// implicit bit, with mbits fraction bits), to a fixed point integer with REAL_FRAC_BITS fraction 
+// bits, saturating at +/- S64_MAX. We can't use floating point in the kernel, so we do this by hand.
+static s64
+tagfd_ieeeToFixed(bool neg, int exp, u64 mant, int mbits)
 {
-	tag_t tmp;
-	struct tag_watcher * watcher = filp->private_data;
+	int shift = exp - mbits + REAL_FRAC_BITS;
+	u64 mag;
 	
-	if(count < sizeof(tag_t))
-		return -EINVAL;
+	if(shift >= 0)
+		mag = (shift >= 63 || mant > ((u64)S64_MAX >> shift)) ? S64_MAX : mant << shift;
+	else
+		mag = (-shift >= 64) ? 0 : mant >> -shift;
+	
+	return neg ? -(s64)mag : (s64)mag;
+}
 
-	// acquire lock on mutex. 
-	if(mutex_lock_interruptible(&watcher->e_ctx->mtx))
-		return -ERESTARTSYS;
+static s64
+tagfd_real32ToFixed(u32 bits)
+{
+	int exp = (bits >> 23) & 0xff;
+	u64 mant = bits & ((1u << 23) - 1);
 	
-	// copy data
-	if(copy_from_user(&tmp,buf,sizeof(tag_t)))
-	{
-		mutex_unlock(&watcher->e_ctx->mtx);
-		return -EFAULT;
-	}
+	if(exp == 0xff) // infinity or NaN
+		return (bits >> 31) ? -S64_MAX : S64_MAX;
+	if(exp == 0)    // subnormal
+		exp = 1;
+	else
+		mant |= 1u << 23;
+	return tagfd_ieeeToFixed(bits >> 31, exp - 127, mant, 23);
+}
+
+static s64
+tagfd_real64ToFixed(u64 bits)
+{
+	int exp = (bits >> 52) & 0x7ff;
+	u64 mant = bits & ((1ull << 52) - 1);
 	
-	// permission check
-	// if they try to change the data type, deny permission
-	if(watcher->e_ctx->tag.dtype != tmp.dtype)
-	{
-		mutex_unlock(&watcher->e_ctx->mtx);
-		return -EPERM;
-	}
-	// if they don't update the timesatmp, the request is invalid
-	if(watcher->e_ctx->tag.timestamp >= tmp.timestamp)
+	if(exp == 0x7ff) // infinity or NaN
+		return (bits >> 63) ? -S64_MAX : S64_MAX;
+	if(exp == 0)     // subnormal
+		exp = 1;
+	else
+		mant |= 1ull << 52;
+	return tagfd_ieeeToFixed(bits >> 63, exp - 1023, mant, 52);
+}
+
+// Gets a tag's value as a number that deadbands can be applied to: integers as they are
+// (unsigned 64 bit values saturate), reals in fixed point. Returns false for data types 
+// that aren't numbers.
+static bool
+tagfd_numericValue(u8 dtype, const tagvalue_t * value, s64 * out)
+{
+	switch(dtype)
 	{
-		mutex_unlock(&watcher->e_ctx->mtx);
-		return -EINVAL;
+		case DT_INT8:   *out = value->i8;  return true;
+		case DT_UINT8:  *out = value->u8;  return true;
+		case DT_INT16:  *out = value->i16; return true;
+		case DT_UINT16: *out = value->u16; return true;
+		case DT_INT32:  *out = value->i32; return true;
+		case DT_UINT32: *out = value->u32; return true;
+		case DT_INT64:  *out = value->i64; return true;
+		case DT_UINT64: *out = min_t(u64, value->u64, S64_MAX); return true;
+		case DT_REAL32: *out = tagfd_real32ToFixed(value->u32); return true;
+		case DT_REAL64: *out = tagfd_real64ToFixed(value->u64); return true;
+		default:
+			return false;
 	}
+}
+
+static inline u64
+tagfd_absDiff(s64 a, s64 b)
+{
+	return a > b ? (u64)a - (u64)b : (u64)b - (u64)a;
+}
+
+// Whether a new value of a tag differs enough from the last one read to be reported.
+static bool
+tagfd_deadbandPasses(struct tag_watcher * watcher, const tag_t * tag)
+{
+	const tag_t * last = &watcher->lastRead;
+	s64 v, lv;
+	u64 band;
 	
-	// copy into place. 
-	memcpy(&watcher->e_ctx->tag, &tmp, sizeof(tag_t));
+	if(watcher->deadband == 0 && watcher->deadband_ppm == 0)
+		return true;
+	// quality changes always get through, and so does the first value. 
+	if(tag->quality != last->quality || tag->dtype != last->dtype)
+		return true;
+	if(!tagfd_numericValue(tag->dtype, &tag->value, &v) || !tagfd_numericValue(last->dtype, &last->value, &lv))
+		return true;
 	
-	// unlock
-	mutex_unlock(&watcher->e_ctx->mtx);
+	band = mul_u64_u32_div(tagfd_absDiff(lv, 0), watcher->deadband_ppm, 1000000);
+	band = max(band, watcher->deadband);
+	return tagfd_absDiff(v, lv) > band;
+}
+
+static enum hrtimer_restart
+tagfd_watcherTimer(struct hrtimer * timer)
+{
+	struct tag_watcher * watcher = container_of(timer, struct tag_watcher, timer);
 	
-	// wake anybody waiting
 	wake_up_interruptible(&watcher->e_ctx->wqh);
-	
-	return sizeof(tag_t);
+	return HRTIMER_NORESTART;
 }
 
-
-static unsigned int 
-tagfd_poll(struct file *filp, poll_table *wait)
+// Whether a watcher has something to read: a new value that gets through its filter. 
+// Fills in *snap with the tag either way. If the only thing holding a change back is the 
+// minimum interval, this arms the watcher's timer, so that waiters get woken up once it passes.
+static bool
+tagfd_watcherReady(struct tag_watcher * watcher, struct tag_ctx * ectx, tagx_t * snap)
 {
-	unsigned int mask = 0;
-	struct tag_watcher * watcher = filp->private_data;
+	u64 now, due;
 	
-	//lock
-	if(mutex_lock_interruptible(&watcher->e_ctx->mtx))
-		return -ERESTARTSYS;
-	// poll wait
-	poll_wait(filp, &watcher->e_ctx->wqh,  wait);
-	// readable
-	if (watcher->ts_lastRead != watcher->e_ctx->tag.timestamp)
-		mask |= POLLIN | POLLRDNORM;	
-	// always writable
-	mask |= POLLOUT | POLLWRNORM;
-	//unlock
-	mutex_unlock(&watcher->e_ctx->mtx);
-	return mask;
+	tagfd_readTag(ectx, snap);
+	
+	if(snap->generation == watcher->gen_lastRead)
+		return false;
+	if(!READ_ONCE(watcher->filtered))
+		return true;
+	if(!tagfd_deadbandPasses(watcher, &snap->tag))
+		return false;
+	
+	if(watcher->min_interval_ns)
+	{
+		now = ktime_get_ns();
+		due = watcher->lastReadNs + watcher->min_interval_ns;
+		if(now < due)
+		{
+			hrtimer_start(&watcher->timer, ns_to_ktime(due), HRTIMER_MODE_ABS);
+			return false;
+		}
+	}
+	return true;
 }
 
-
-struct file_operations tagfd_tag_ctx_fops = {
-	.owner = THIS_MODULE,
-	.open = tagfd_open,
-	.release = tagfd_release,
-	.read = tagfd_read,
-	.write = tagfd_write,
-	.poll = tagfd_poll,
+// A reader waiting in tagfd_watcherWait.
+struct tag_wait
+{
+	wait_queue_entry_t   wq;
+	struct tag_watcher * watcher;
 };
 
+// Wake function for readers with a deadband: a write that the deadband holds back doesn't
+// wake them at all (rather than waking them to find that out and go back to sleep). 
+// The minimum interval is left to tagfd_watcherReady, which sets the timer for it. 
+// Called from wake_up with the wait queue's lock held, and from the watcher's timer in 
+// hardirq context, possibly on a CPU that's in the middle of writing the tag. So it makes
+// a single attempt at a snapshot, and wakes the reader if the tag (or the reader's last 
+// value) is being changed underneath it, rather than waiting for that to finish.
+static int
+tagfd_watcherWake(wait_queue_entry_t * wq, unsigned mode, int sync, void * key)
+{
+	struct tag_watcher * watcher = container_of(wq, struct tag_wait, wq)->watcher;
+	struct tag_ctx * ectx = watcher->e_ctx;
+	unsigned int seq, lastSeq;
+	bool held;
+	tagx_t snap;
+	
+	if(READ_ONCE(watcher->filtered) && !READ_ONCE(ectx->deleted))
+	{
+		seq = raw_read_seqcount(&ectx->seq);
+		lastSeq = raw_read_seqcount(&watcher->lastSeq);
+		if(!(seq & 1) && !(lastSeq & 1))
+		{
+			tagfd_snapshot(ectx, &snap);
+			held = snap.generation == watcher->gen_lastRead || !tagfd_deadbandPasses(watcher, &snap.tag);
+			if(held && !read_seqcount_retry(&ectx->seq, seq) && !read_seqcount_retry(&watcher->lastSeq, lastSeq))
+				return 0;
+		}
+	}
+	return autoremove_wake_function(wq, mode, sync, key);
+}
 
-// -----------------------------------------
-// Constructor and destructor for struct tag_ctx
-// -----------------------------------------
-
-
-// constructor 
+// Waits (interruptibly) until the watcher has a new value that gets through its filter, 
+// which is left in *snap, or its tag is deleted. If deadline isn't NULL, gives up at 
+// that (CLOCK_MONOTONIC) time. Returns 0, -ERESTARTSYS, or -ETIMEDOUT.
+static int
+tagfd_watcherWait(struct tag_watcher * watcher, struct tag_ctx * ectx, tagx_t * snap, ktime_t * deadline)
+{
+	struct tag_wait w;
+	int err = 0;
+	
+	init_wait(&w.wq);
+	w.wq.func = tagfd_watcherWake;
+	w.watcher = watcher;
+	
+	for(;;)
+	{
+		prepare_to_wait(&ectx->wqh, &w.wq, TASK_INTERRUPTIBLE);
+		if(tagfd_watcherReady(watcher, ectx, snap) || READ_ONCE(ectx->deleted))
+			break;
+		if(signal_pending(current))
+		{
+			err = -ERESTARTSYS;
+			break;
+		}
+		if(deadline == NULL)
+		{
+			schedule();
+		}
+		else if(schedule_hrtimeout(deadline, HRTIMER_MODE_ABS) == 0)
+		{
+			// one last look, in case the value arrived with the deadline
+			if(!tagfd_watcherReady(watcher, ectx, snap) && !READ_ONCE(ectx->deleted))
+				err = -ETIMEDOUT;
+			break;
+		}
+	}
+	finish_wait(&ectx->wqh, &w.wq);
+	return err;
+}
+
+// Records that a value was read, for the filter. Several threads can read the same file.
+static void
+tagfd_watcherRead(struct tag_watcher * watcher, const tagx_t * tag)
+{
+	spin_lock(&watcher->lastLock);
+	write_seqcount_begin(&watcher->lastSeq);
+	watcher->gen_lastRead = tag->generation;
+	watcher->lastRead = tag->tag;
+	watcher->lastReadNs = ktime_get_ns();
+	write_seqcount_end(&watcher->lastSeq);
+	spin_unlock(&watcher->lastLock);
+}
+
+static long
+tagfd_setFilter(struct tag_watcher * watcher, struct tag_ctx * ectx, unsigned long arg)
+{
+	struct tag_filter filter;
+	s64 deadband;
+	
+	if(copy_from_user(&filter, (void __user *)arg, sizeof(filter)))
+		return -EFAULT;
+	
+	// The deadband is in the tag's own data type, and only makes sense for numbers.
+	if(!tagfd_numericValue(ectx->tag.dtype, &filter.deadband, &deadband))
+	{
+		if(memchr_inv(&filter.deadband, 0, sizeof(filter.deadband)) || filter.deadband_ppm)
+			return -EINVAL;
+		deadband = 0;
+	}
+	
+	WRITE_ONCE(watcher->filtered, false);
+	hrtimer_cancel(&watcher->timer);
+	watcher->deadband = tagfd_absDiff(deadband, 0);
+	watcher->deadband_ppm = filter.deadband_ppm;
+	watcher->min_interval_ns = filter.min_interval_ns;
+	WRITE_ONCE(watcher->filtered, watcher->deadband || watcher->deadband_ppm || watcher->min_interval_ns);
+	
+	// a new filter might let through a change that was held back.
+	wake_up_interruptible(&ectx->wqh);
+	return 0;
+}
+
+
+
+
+// -----------------------------------------
+// Queue mode
+// -----------------------------------------
+
+// Adds a value to a watcher's ring, dropping the oldest value if it's full. 
+// Called by writers, with the tag's lock held.
+static void
+tagfd_queuePush(struct tag_watcher * watcher, const tagx_t * tag)
+{
+	spin_lock(&watcher->qlock);
+	if(watcher->qhead - watcher->qtail == watcher->depth)
+	{
+		watcher->qtail++;
+		watcher->overflow++;
+	}
+	watcher->ring[watcher->qhead % watcher->depth] = *tag;
+	watcher->qhead++;
+	spin_unlock(&watcher->qlock);
+}
+
+static bool
+tagfd_queuePending(struct tag_watcher * watcher)
+{
+	bool ret;
+	
+	spin_lock(&watcher->qlock);
+	ret = watcher->qhead != watcher->qtail;
+	spin_unlock(&watcher->qlock);
+	return ret;
+}
+
+// Turns queue mode on (with a ring of the given depth), or off (depth 0). 
+// Changing the depth discards anything that's queued.
+static long
+tagfd_setQueue(struct tag_watcher * watcher, struct tag_ctx * ectx, u32 depth)
+{
+	tagx_t * ring = NULL, * old;
+	
+	if(depth > TAGFD_QUEUE_MAX)
+		return -EINVAL;
+	if(depth)
+	{
+		ring = kvmalloc_array(depth, sizeof(tagx_t), GFP_KERNEL);
+		if(ring == NULL)
+			return -ENOMEM;
+	}
+	
+	spin_lock(&ectx->lock);
+	if(ring && watcher->aggregate)
+	{
+		spin_unlock(&ectx->lock);
+		kvfree(ring);
+		return -EBUSY;
+	}
+	spin_lock(&watcher->qlock);
+	old = watcher->ring;
+	watcher->ring = ring;
+	watcher->depth = depth;
+	watcher->qhead = watcher->qtail = 0;
+	watcher->qepoch++;
+	if(ring && list_empty(&watcher->queueNode))
+		list_add_tail(&watcher->queueNode, &ectx->queues);
+	else if(!ring)
+		list_del_init(&watcher->queueNode);
+	spin_unlock(&watcher->qlock);
+	spin_unlock(&ectx->lock);
+	
+	kvfree(old);
+	return 0;
+}
+
+// Number of values copied out of the ring at a time.
+#define QUEUE_READ_BATCH 8
+
+// read() in queue mode: drains as many values as fit in the user's buffer.
+static ssize_t
+tagfd_queueRead(struct tag_watcher * watcher, struct tag_ctx * ectx, struct iov_iter * to, bool nowait)
+{
+	tagx_t batch[QUEUE_READ_BATCH];
+	size_t len = tagfd_recordSize(watcher);
+	size_t count = iov_iter_count(to);
+	size_t done = 0;
+	u64 tail, epoch;
+	u32 i, n;
+	bool waited = false;
+	
+	// values queued before the tag was deleted can still be read.
+	while(!tagfd_queuePending(watcher))
+	{
+		if(READ_ONCE(ectx->deleted))
+			return -EIDRM;
+		if(nowait)
+			return -EAGAIN;
+		waited = true;
+		if(wait_event_interruptible(ectx->wqh, tagfd_queuePending(watcher) || READ_ONCE(ectx->deleted)))
+			return -ERESTARTSYS;
+	}
+	
+	while(done + len <= count)
+	{
+		// Copy a batch out of the ring, so that we don't copy to userspace with the lock held.
+		// Another thread can change the depth (or leave queue mode) at any time, which 
+		// starts the ring over, so the batch is only taken off the ring if it's still the same one.
+		spin_lock(&watcher->qlock);
+		tail = watcher->qtail;
+		epoch = watcher->qepoch;
+		n = 0;
+		if(watcher->ring)
+			n = min_t(u64, watcher->qhead - tail, min_t(size_t, QUEUE_READ_BATCH, (count - done) / len));
+		for(i = 0; i < n; i++)
+			batch[i] = watcher->ring[(tail + i) % watcher->depth];
+		spin_unlock(&watcher->qlock);
+		
+		if(n == 0)
+			break;
+		
+		for(i = 0; i < n; i++)
+		{
+			if(copy_to_iter(&batch[i], len, to) != len)
+				break;
+			done += len;
+		}
+		
+		// Writers may have dropped some of these values (as overflow) in the meantime,
+		// in which case the tail has already moved past them.
+		spin_lock(&watcher->qlock);
+		if(watcher->qepoch == epoch)
+			watcher->qtail = max(watcher->qtail, tail + i);
+		spin_unlock(&watcher->qlock);
+		if(i)
+		{
+			tagfd_watcherRead(watcher, &batch[i-1]);
+			tagfd_countRead(ectx, &batch[i-1], i, waited);
+			waited = false;
+		}
+		
+		if(i < n)
+			return done ? done : -EFAULT;
+	}
+	
+	return done;
+}
+
+
+
+
+// -----------------------------------------
+// Aggregate mode
+// -----------------------------------------
+
+// Adds a value written to the tag to a watcher's statistics. Called by writers, with the 
+// tag's lock held. 
+static void
+tagfd_aggAdd(struct tag_watcher * watcher, const tag_t * tag)
+{
+	struct tag_agg * a = &watcher->agg;
+	s64 v = 0;
+	bool numeric = tagfd_numericValue(tag->dtype, &tag->value, &v);
+	
+	// the first value, or one of a different type (the tag was retyped), starts over
+	if(a->updates == 0 || a->dtype != tag->dtype)
+	{
+		a->dtype = tag->dtype;
+		a->numeric = numeric;
+		a->min = a->max = tag->value;
+		a->minN = a->maxN = a->sum = v;
+	}
+	else if(numeric)
+	{
+		if(v < a->minN)
+		{
+			a->minN = v;
+			a->min = tag->value;
+		}
+		if(v > a->maxN)
+		{
+			a->maxN = v;
+			a->max = tag->value;
+		}
+		if(check_add_overflow(a->sum, v, &a->sum))
+			a->sum = v > 0 ? S64_MAX : S64_MIN;
+	}
+	a->updates++;
+}
+
+// Takes the tag's latest value and the watcher's statistics, and starts the statistics over. 
+static void
+tagfd_aggTake(struct tag_watcher * watcher, struct tag_ctx * ectx, tagx_t * snap, struct tag_aggregate * out)
+{
+	struct tag_agg * a = &watcher->agg;
+	s64 v;
+	
+	memset(out, 0, sizeof(*out));
+	
+	spin_lock(&ectx->lock);
+	tagfd_snapshot(ectx, snap);
+	out->tag = *snap;
+	out->updates = a->updates;
+	out->numeric = tagfd_numericValue(snap->tag.dtype, &snap->tag.value, &v);
+	if(a->updates && a->numeric && a->dtype == snap->tag.dtype)
+	{
+		out->min = a->min;
+		out->max = a->max;
+		out->sum = a->sum;
+	}
+	memset(a, 0, sizeof(*a));
+	spin_unlock(&ectx->lock);
+}
+
+// Turns aggregate mode on or off. 
+static long
+tagfd_setAggregate(struct tag_watcher * watcher, struct tag_ctx * ectx, bool on)
+{
+	long err = 0;
+	
+	spin_lock(&ectx->lock);
+	if(on && watcher->ring)
+	{
+		err = -EBUSY;
+	}
+	else if(on && !watcher->aggregate)
+	{
+		memset(&watcher->agg, 0, sizeof(watcher->agg));
+		list_add_tail(&watcher->aggNode, &ectx->aggs);
+		WRITE_ONCE(watcher->aggregate, true);
+	}
+	else if(!on && watcher->aggregate)
+	{
+		list_del_init(&watcher->aggNode);
+		WRITE_ONCE(watcher->aggregate, false);
+	}
+	spin_unlock(&ectx->lock);
+	
+	return err;
+}
+
+
+
+
+// -----------------------------------------
+// tag_ctx file ops
+// -----------------------------------------
+
+
+// Sets up a watcher for a file, which isn't bound to a tag yet (see tagfd_attach).
+static int 
+tagfd_newWatcher(struct file * filp)
+{
+	struct tag_watcher * watcher = kzalloc(sizeof(struct tag_watcher), GFP_KERNEL);
+	if(watcher == NULL)
+	{
+		return -ENOMEM;
+	}
+	
+	hrtimer_init(&watcher->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	watcher->timer.function = tagfd_watcherTimer;
+	INIT_LIST_HEAD(&watcher->queueNode);
+	INIT_LIST_HEAD(&watcher->aggNode);
+	spin_lock_init(&watcher->qlock);
+	spin_lock_init(&watcher->lastLock);
+	seqcount_init(&watcher->lastSeq);
+	
+	// reads honour IOCB_NOWAIT, and so do writes (which only ever sleep for an array 
+	// tag's elements), so io_uring can poll for readiness instead of handing blocked 
+	// reads to a worker.
+	filp->f_mode |= FMODE_NOWAIT;
+	filp->private_data = watcher;
+	
+	return 0;
+}
+
+// Binds a watcher to a tag, unless the tag has been deleted. Call under rcu_read_lock, from
+// before the tag was looked up: that way, the tag can't be deleted and its slot given to 
+// another tag before it's counted as open (see tagfd_allocTag). 
+// Returns 0, -ENOENT, or -EISCONN if the watcher is already bound. 
+static int
+tagfd_attach(struct tag_watcher * watcher, struct tag_ctx * ectx)
+{
+	if(ectx == NULL || READ_ONCE(ectx->deleted))
+		return -ENOENT;
+	// a watcher can only be bound once
+	if(cmpxchg(&watcher->e_ctx, NULL, ectx) != NULL)
+		return -EISCONN;
+	atomic_inc(&ectx->stats.watchers);
+	return 0;
+}
+
+static int 
+tagfd_open(struct inode * inode, struct file * filp)
+{
+	int err;
+	
+	err = tagfd_newWatcher(filp);
+	if(err)
+		return err;
+	
+	// The minor number is the tag's ID, and its slot may hold a newer tag than the one whose
+	// device was looked up, in which case that tag is the one that gets opened. 
+	rcu_read_lock();
+	err = tagfd_attach(filp->private_data, tagfd_tagSlot(iminor(inode) - NSYSDEVS));
+	rcu_read_unlock();
+	if(err)
+		kfree(filp->private_data);
+	return err;
+}
+
+// Opening /dev/tagfd.tag gives a watcher that isn't bound to a tag yet. 
+static int 
+tagfd_bindOpen(struct inode * inode, struct file * filp)
+{
+	return tagfd_newWatcher(filp);
+}
+
+// The tag a watcher is bound to, or NULL if it isn't bound yet. 
+// A watcher's tag can't change once it's set, so no locking is needed.
+static inline struct tag_ctx *
+tagfd_boundTag(struct tag_watcher * watcher)
+{
+	return READ_ONCE(watcher->e_ctx);
+}
+
+// Binds a watcher (from /dev/tagfd.tag) to a tag, by ID or by name.
+static long
+tagfd_bind(struct tag_watcher * watcher, unsigned int cmd, unsigned long arg)
+{
+	struct tag_lookup __user * ureq = (struct tag_lookup __user *)arg;
+	struct tag_ctx * ectx;
+	char name[TAG_NAME_LENGTH];
+	uint32_t id;
+	int err;
+	
+	if(cmd == TAGFD_IOC_BIND && get_user(id, (uint32_t __user *)arg))
+		return -EFAULT;
+	if(cmd == TAGFD_IOC_BINDNAME && (err = tagfd_copyUserName(name, ureq->name)))
+		return err;
+	
+	rcu_read_lock();
+	ectx = cmd == TAGFD_IOC_BIND ? tagfd_getTag(id) : tagfd_findByName(name, strlen(name));
+	err = tagfd_attach(watcher, ectx);
+	rcu_read_unlock();
+	if(err)
+		return err;
+	
+	if(cmd == TAGFD_IOC_BINDNAME)
+		return put_user((uint32_t)ectx->id, &ureq->id);
+	return 0;
+}
+
+static int
+tagfd_release(struct inode * inode, struct file * filp)
+{
+	struct tag_watcher * watcher = filp->private_data;
+	
+	hrtimer_cancel(&watcher->timer);
+	if(watcher->ring)
+		tagfd_setQueue(watcher, watcher->e_ctx, 0);
+	if(watcher->aggregate)
+		tagfd_setAggregate(watcher, watcher->e_ctx, false);
+	if(watcher->e_ctx)
+		atomic_dec(&watcher->e_ctx->stats.watchers);
+	kfree(watcher);
+	return 0;
+}
+
+
+// read(), readv(), and asynchronous reads (e.g. io_uring, which sets IOCB_NOWAIT 
+// and then waits for POLLIN if we return -EAGAIN).
+static ssize_t
+tagfd_readIter(struct kiocb * iocb, struct iov_iter * to)
+{
+	tagx_t tmp;
+	struct tag_aggregate agg;
+	struct file * filp = iocb->ki_filp;
+	struct tag_watcher * watcher = filp->private_data;
+	struct tag_ctx * ectx = tagfd_boundTag(watcher);
+	bool aggregate = READ_ONCE(watcher->aggregate);
+	size_t len = aggregate ? sizeof(agg) : tagfd_recordSize(watcher);
+	bool nowait = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	bool waited = false;
+	
+	if(ectx == NULL)
+		return -EBADFD;
+	if(iov_iter_count(to) < len + ectx->arrayBytes)
+		return -EINVAL;
+	
+	if(READ_ONCE(watcher->ring))
+		return tagfd_queueRead(watcher, ectx, to, nowait);
+	
+	// Readers don't take the tag's lock, they just retry if a writer gets in the way.
+	// while no new value (that gets through our filter)
+	while (!tagfd_watcherReady(watcher, ectx, &tmp))
+	{ 
+		if(READ_ONCE(ectx->deleted))
+			return -EIDRM;
+		
+		// if we're in non-blocking mode, don't block. 
+		if(nowait)
+			return -EAGAIN;
+		
+		// if we can block, do so. 
+		waited = true;
+		if(tagfd_watcherWait(watcher, ectx, &tmp, NULL))
+			return -ERESTARTSYS;
+	}
+	if(READ_ONCE(ectx->deleted))
+		return -EIDRM;
+	
+	// ok, data is available. 
+	if(aggregate)
+	{
+		// the statistics go with the latest value, which may be newer than tmp
+		tagfd_aggTake(watcher, ectx, &tmp, &agg);
+		if(copy_to_iter(&agg, len, to) != len)
+			return -EFAULT;
+	}
+	else if(ectx->array)
+	{
+		// so do an array's elements
+		if(tagfd_arrayRead(ectx, &tmp, len, to))
+			return -EFAULT;
+	}
+	else if(copy_to_iter(&tmp, len, to) != len)
+		return -EFAULT;
+	tagfd_watcherRead(watcher, &tmp);
+	tagfd_countRead(ectx, &tmp, 1, waited);
+	
+	return len + ectx->arrayBytes;
+}
+
+// TAGFD_IOC_WAITREAD: a blocking read with a timeout, which saves a poll() before 
+// each read() for programs that only wait on one tag.
+static long
+tagfd_waitRead(struct tag_watcher * watcher, struct tag_ctx * ectx, unsigned long arg)
+{
+	struct tag_waitread __user * ureq = (struct tag_waitread __user *)arg;
+	uint64_t timeout_ns;
+	ktime_t deadline;
+	tagx_t tmp;
+	bool waited = false;
+	int err;
+	
+	if(get_user(timeout_ns, &ureq->timeout_ns))
+		return -EFAULT;
+	if(READ_ONCE(watcher->ring) || READ_ONCE(watcher->aggregate))
+		return -EBUSY;
+	if(ectx->array)
+		return -EOPNOTSUPP;
+	
+	if(!tagfd_watcherReady(watcher, ectx, &tmp) && !READ_ONCE(ectx->deleted))
+	{
+		if(timeout_ns == 0)
+			return -ETIMEDOUT;
+		waited = true;
+		deadline = ktime_add_safe(ktime_get(), ns_to_ktime(min_t(u64, timeout_ns, KTIME_MAX)));
+		err = tagfd_watcherWait(watcher, ectx, &tmp, timeout_ns == TAGFD_WAIT_FOREVER ? NULL : &deadline);
+		// not restarted, since the restart would wait the whole timeout again
+		if(err == -ERESTARTSYS)
+			return -EINTR;
+		if(err)
+			return err;
+	}
+	if(READ_ONCE(ectx->deleted))
+		return -EIDRM;
+	
+	if(copy_to_user(&ureq->tag, &tmp, sizeof(tmp)))
+		return -EFAULT;
+	tagfd_watcherRead(watcher, &tmp);
+	tagfd_countRead(ectx, &tmp, 1, waited);
+	
+	return 0;
+}
+
+// Checks whether a write to a tag is allowed. Call with the tag's lock held. array says 
+// whether the write comes with an array tag's elements (see tagfd_writeArray). 
+// Returns 0, or a negative errno value if the write would be rejected. 
+static int
+tagfd_checkWrite(struct tag_ctx * ectx, const tagx_t * tmp, bool extended, bool array)
+{
+	if(ectx->deleted)
+		return -EIDRM;
+	
+	// array tags can only be written whole
+	if(ectx->array && !array)
+		return -EOPNOTSUPP;
+	
+	// permission check
+	// if they try to change the data type, deny permission
+	if(ectx->tag.dtype != tmp->tag.dtype)
+		return -EPERM;
+	
+	// writes can't go back in time (checked at the writer's resolution). 
+	// Equal timestamps are fine, change detection uses the generation.
+	// A tag that has never been written (still at generation 1, with the time it 
+	// was created) takes any timestamp, so that saved values can be restored as 
+	// they were (see tfdsnapshot). 
+	if(ectx->generation > 1 &&
+	   ((extended && tmp->timestamp_ns < ectx->timestamp_ns) ||
+	    (!extended && tmp->tag.timestamp < ectx->tag.timestamp)))
+		return -EINVAL;
+	
+	return 0;
+}
+
+// Stores a (checked) write and tells everybody who needs to know, except for the 
+// wakeups, which are done by tagfd_wakeWaiters once the lock is dropped. 
+// Call with the tag's lock held. *tmp is updated to hold the tag as stored 
+// (generation and both timestamps). array is set for a write to an array tag, whose 
+// elements are waiting in the copy that isn't active (see tagfd_writeArray). 
+// Returns whether the write was journaled.
+static bool
+tagfd_commitWrite(struct tag_ctx * ectx, tagx_t * tmp, bool extended, bool array)
+{
+	struct tag_sub * sub;
+	struct tag_watcher * watcher;
+	u64 timestamp_ns;
+	bool journaled;
+	
+	if(extended)
+	{
+		tmp->tag.timestamp = div_u64(tmp->timestamp_ns, NSEC_PER_MSEC);
+		timestamp_ns = tmp->timestamp_ns;
+	}
+	else
+	{
+		// within the same millisecond, don't let the full resolution timestamp go backwards.
+		timestamp_ns = max_t(u64, tmp->tag.timestamp * NSEC_PER_MSEC, ectx->timestamp_ns);
+	}
+	
+	// copy into place. 
+	write_seqcount_begin(&ectx->seq);
+	memcpy(&ectx->tag, &tmp->tag, sizeof(tag_t));
+	ectx->timestamp_ns = timestamp_ns;
+	ectx->generation++;
+	if(array)
+		tagfd_arrayPublish(ectx, true);
+	write_seqcount_end(&ectx->seq);
+	
+	ectx->stats.writes++;
+	if(READ_ONCE(stats_timing))
+		WRITE_ONCE(ectx->commitNs, ktime_get_ns());
+	trace_tagfd_write(ectx->id, ectx->generation, 0);
+	
+	tagfd_publish(ectx);
+	tagfd_snapshot(ectx, tmp);
+	
+	// tell the subscription devices
+	list_for_each_entry(sub, &ectx->subs, tagNode)
+		tagfd_subNotify(sub);
+	
+	// and the watchers in queue mode
+	list_for_each_entry(watcher, &ectx->queues, queueNode)
+		tagfd_queuePush(watcher, tmp);
+	
+	// and in aggregate mode
+	list_for_each_entry(watcher, &ectx->aggs, aggNode)
+		tagfd_aggAdd(watcher, &tmp->tag);
+	
+	// and the journal
+	journaled = atomic_read(&gl_journalReaders) > 0;
+	if(journaled)
+		tagfd_journalAppend(ectx, tmp);
+	
+	return journaled;
+}
+
+// Wakes the journal's readers, if there are any waiting. 
+static void
+tagfd_wakeJournal(void)
+{
+	if(wq_has_sleeper(&gl_journalWqh))
+		wake_up_interruptible(&gl_journalWqh);
+}
+
+// Wakes anybody waiting on a tag, after tagfd_commitWrite. Call without the lock.
+// Most writes have nobody waiting, so the wait queue's lock is only taken if somebody is. 
+// wq_has_sleeper's barrier pairs with the one a reader has between adding itself to the 
+// queue and checking for a new value (in prepare_to_wait, or after poll_wait in tagfd_poll), 
+// so a reader either sees this write or is on the queue to be woken by it.
+static void
+tagfd_wakeWaiters(struct tag_ctx * ectx, bool journaled)
+{
+	if(wq_has_sleeper(&ectx->wqh))
+	{
+		atomic64_inc(&ectx->stats.wakeups);
+		trace_tagfd_wake(ectx->id, READ_ONCE(ectx->generation));
+		wake_up_interruptible(&ectx->wqh);
+	}
+	if(journaled)
+		tagfd_wakeJournal();
+}
+
+// Whether a write with these flags (TAGFD_FLAG_*) has a full resolution timestamp. 
+static inline bool
+tagfd_extendedWrite(u32 flags)
+{
+	return flags & (TAGFD_FLAG_EXTENDED | TAGFD_FLAG_KERNELTIME);
+}
+
+// Stamps a write with the current time, but no earlier than the tag's (so that it's 
+// never rejected for going back in time). Call with the tag's lock held. 
+static void
+tagfd_stampWrite(struct tag_ctx * ectx, tagx_t * tmp)
+{
+	tmp->timestamp_ns = max_t(u64, ktime_get_real_ns(), ectx->timestamp_ns);
+}
+
+// For read-modify-write operations: called by tagfd_writeTag with the tag's lock held,
+// after the checks and before the update. It can change the value to be written (tmp). 
+// Returns 0 to go ahead with the write, 1 to skip it, or a negative errno value.
+typedef int (*tagfd_modify_t)(struct tag_ctx * ectx, tagx_t * tmp, void * arg);
+
+// Applies a write to a tag: the checks, the update, and the notifications. flags are 
+// the writer's TAGFD_FLAG_* (for how the write is timestamped). 
+// On success, *tmp is updated to hold the tag as stored (generation and both timestamps).
+// If modify is given, it is called (with arg) before the update, and if it skips the 
+// write, *tmp is updated to hold the tag as it is. 
+// Returns 0, 1 if modify skipped the write, or a negative errno value if the write was rejected. 
+static int
+tagfd_writeTag(struct tag_ctx * ectx, tagx_t * tmp, u32 flags, tagfd_modify_t modify, void * arg)
+{
+	bool extended = tagfd_extendedWrite(flags);
+	bool journaled;
+	u64 locked;
+	int err;
+
+	// writers serialize on the tag's lock. 
+	locked = tagfd_lockWrite(ectx);
+	
+	if(flags & TAGFD_FLAG_KERNELTIME)
+		tagfd_stampWrite(ectx, tmp);
+	err = tagfd_checkWrite(ectx, tmp, extended, false);
+	if(!err && modify)
+		err = modify(ectx, tmp, arg);
+	if(err)
+	{
+		if(err > 0)
+			tagfd_snapshot(ectx, tmp);
+		else
+			tagfd_rejectWrite(ectx, err);
+		tagfd_unlockWrite(ectx, locked);
+		return err;
+	}
+	
+	journaled = tagfd_commitWrite(ectx, tmp, extended, false);
+	tagfd_unlockWrite(ectx, locked);
+	
+	// wake anybody waiting
+	tagfd_wakeWaiters(ectx, journaled);
+	
+	return 0;
+}
+
+// Applies a write to an array tag, just like tagfd_writeTag, with its elements taken from
+// the rest of from. The value written is the array's length. The elements are copied in 
+// (with only the array's mutex held) to the copy that isn't active, which the commit then 
+// makes active, so the tag's lock is only held for as long as any other write. 
+// If nowait is set, returns -EAGAIN rather than waiting for another writer of the elements.
+static int
+tagfd_writeArray(struct tag_ctx * ectx, tagx_t * tmp, u32 flags, struct iov_iter * from, bool nowait)
+{
+	bool extended = tagfd_extendedWrite(flags);
+	bool journaled;
+	u64 locked;
+	int err;
+	
+	memset(&tmp->tag.value, 0, sizeof(tagvalue_t));
+	tmp->tag.value.u32 = ectx->array->length;
+	
+	if(nowait)
+	{
+		if(!mutex_trylock(&ectx->arrayMtx))
+			return -EAGAIN;
+	}
+	else if(mutex_lock_interruptible(&ectx->arrayMtx))
+	{
+		return -ERESTARTSYS;
+	}
+	
+	// only writers change which copy is active, and they all hold the mutex
+	if(!copy_from_iter_full(TAG_ARRAY_ELEMENTS(ectx->array, !ectx->array->active), ectx->arrayBytes, from))
+	{
+		mutex_unlock(&ectx->arrayMtx);
+		return -EFAULT;
+	}
+	
+	locked = tagfd_lockWrite(ectx);
+	
+	if(flags & TAGFD_FLAG_KERNELTIME)
+		tagfd_stampWrite(ectx, tmp);
+	err = tagfd_checkWrite(ectx, tmp, extended, true);
+	if(err)
+	{
+		tagfd_rejectWrite(ectx, err);
+		tagfd_unlockWrite(ectx, locked);
+		mutex_unlock(&ectx->arrayMtx);
+		return err;
+	}
+	
+	journaled = tagfd_commitWrite(ectx, tmp, extended, true);
+	tagfd_unlockWrite(ectx, locked);
+	mutex_unlock(&ectx->arrayMtx);
+	
+	tagfd_wakeWaiters(ectx, journaled);
+	
+	return 0;
+}
+
+// The number of bytes of a tagvalue_t that a data type uses.
+static size_t
+tagfd_valueSize(u8 dtype)
+{
+	switch(dtype)
+	{
+		case DT_INT8:
+		case DT_UINT8:     return 1;
+		case DT_INT16:
+		case DT_UINT16:    return 2;
+		case DT_INT32:
+		case DT_UINT32:
+		case DT_REAL32:    return 4;
+		case DT_INT64:
+		case DT_UINT64:
+		case DT_REAL64:
+		case DT_TIMESTAMP: return 8;
+		default:           return sizeof(tagvalue_t);
+	}
+}
+
+// Compare-and-swap: only write if the value is (bit for bit) what the caller expected.
+static int
+tagfd_casModify(struct tag_ctx * ectx, tagx_t * tmp, void * arg)
+{
+	const tagvalue_t * expected = arg;
+	
+	if(memcmp(&ectx->tag.value, expected, tagfd_valueSize(ectx->tag.dtype)))
+		return 1;
+	return 0;
+}
+
+// Fetch-add: the value written is the current value plus a delta, wrapping around
+// at the width of the data type. The old value is passed back in the struct.
+static int
+tagfd_addModify(struct tag_ctx * ectx, tagx_t * tmp, void * arg)
+{
+	struct tag_fetchadd * req = arg;
+	const tagvalue_t * cur = &ectx->tag.value;
+	
+	req->old = *cur;
+	switch(ectx->tag.dtype)
+	{
+		case DT_INT8:
+		case DT_UINT8:  tmp->tag.value.u8  = cur->u8  + (u8)req->delta;  break;
+		case DT_INT16:
+		case DT_UINT16: tmp->tag.value.u16 = cur->u16 + (u16)req->delta; break;
+		case DT_INT32:
+		case DT_UINT32: tmp->tag.value.u32 = cur->u32 + (u32)req->delta; break;
+		case DT_INT64:
+		case DT_UINT64: tmp->tag.value.u64 = cur->u64 + (u64)req->delta; break;
+		default:        return -EINVAL;
+	}
+	return 0;
+}
+
+// TAGFD_IOC_CAS and TAGFD_IOC_FETCHADD.
+static long
+tagfd_atomicOp(struct tag_watcher * watcher, struct tag_ctx * ectx, unsigned int cmd, unsigned long arg)
+{
+	u32 flags = watcher->flags;
+	struct tag_cas cas;
+	struct tag_fetchadd add;
+	int err;
+	
+	if(cmd == TAGFD_IOC_CAS)
+	{
+		if(copy_from_user(&cas, (void __user *)arg, sizeof(cas)))
+			return -EFAULT;
+		err = tagfd_writeTag(ectx, &cas.tag, flags, tagfd_casModify, &cas.expected);
+		if(err < 0)
+			return err;
+		cas.swapped = (err == 0);
+		return copy_to_user((void __user *)arg, &cas, sizeof(cas)) ? -EFAULT : 0;
+	}
+	else
+	{
+		if(copy_from_user(&add, (void __user *)arg, sizeof(add)))
+			return -EFAULT;
+		err = tagfd_writeTag(ectx, &add.tag, flags, tagfd_addModify, &add);
+		if(err < 0)
+			return err;
+		return copy_to_user((void __user *)arg, &add, sizeof(add)) ? -EFAULT : 0;
+	}
+}
+
+// write(), writev(), and asynchronous writes. Writes only ever spin on the tag's 
+// lock, except for array tags' elements (see tagfd_writeArray), which honour IOCB_NOWAIT. 
+static ssize_t
+tagfd_writeIter(struct kiocb * iocb, struct iov_iter * from)
+{
+	tagx_t tmp;
+	int err;
+	struct tag_watcher * watcher = iocb->ki_filp->private_data;
+	struct tag_ctx * ectx = tagfd_boundTag(watcher);
+	size_t len = tagfd_recordSize(watcher);
+	
+	if(ectx == NULL)
+		return -EBADFD;
+	if(iov_iter_count(from) < len + ectx->arrayBytes)
+		return -EINVAL;
+	
+	// copy data
+	if(!copy_from_iter_full(&tmp, len, from))
+		return -EFAULT;
+	
+	// an array tag's elements follow the tag
+	if(ectx->array)
+		err = tagfd_writeArray(ectx, &tmp, watcher->flags, from, iocb->ki_flags & IOCB_NOWAIT);
+	else
+		err = tagfd_writeTag(ectx, &tmp, watcher->flags, NULL, NULL);
+	if(err)
+		return err;
+	
+	return len + ectx->arrayBytes;
+}
+
+// Maps an array tag's struct tag_array_shm, read-only. 
+static int
+tagfd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct tag_watcher * watcher = filp->private_data;
+	struct tag_ctx * ectx = tagfd_boundTag(watcher);
+	
+	if(ectx == NULL)
+		return -EBADFD;
+	if(ectx->array == NULL)
+		return -ENODEV;
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	
+	return remap_vmalloc_range(vma, ectx->array, vma->vm_pgoff);
+}
+
+
+static unsigned int 
+tagfd_poll(struct file *filp, poll_table *wait)
+{
+	unsigned int mask = 0;
+	tagx_t tmp;
+	struct tag_watcher * watcher = filp->private_data;
+	struct tag_ctx * ectx = tagfd_boundTag(watcher);
+	
+	if(ectx == NULL)
+		return POLLERR;
+	
+	// poll wait
+	poll_wait(filp, &ectx->wqh,  wait);
+	smp_mb(); // pairs with wq_has_sleeper in tagfd_wakeWaiters
+	// gone (read will say so)
+	if(READ_ONCE(ectx->deleted) && !(READ_ONCE(watcher->ring) && tagfd_queuePending(watcher)))
+		return POLLIN | POLLRDNORM | POLLERR | POLLHUP;
+	// readable
+	if (READ_ONCE(watcher->ring) ? tagfd_queuePending(watcher) : tagfd_watcherReady(watcher, ectx, &tmp))
+		mask |= POLLIN | POLLRDNORM;	
+	// always writable
+	mask |= POLLOUT | POLLWRNORM;
+	return mask;
+}
+
+static long
+tagfd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct tag_watcher * watcher = filp->private_data;
+	struct tag_ctx * ectx = tagfd_boundTag(watcher);
+	uint32_t flags, depth;
+	uint64_t overflow;
+	
+	switch(cmd)
+	{
+		case TAGFD_IOC_BIND:
+		case TAGFD_IOC_BINDNAME:
+			return tagfd_bind(watcher, cmd, arg);
+			
+		case TAGFD_IOC_GETID:
+			if(ectx == NULL)
+				return -EBADFD;
+			return put_user((uint32_t)ectx->id, (uint32_t __user *)arg);
+			
+		case TAGFD_IOC_GETPERIOD:
+			if(ectx == NULL)
+				return -EBADFD;
+			return put_user(ectx->timer ? ectx->timer->period_ns : 0, (uint64_t __user *)arg);
+			
+		case TAGFD_IOC_GETFLAGS:
+			return put_user(watcher->flags, (uint32_t __user *)arg);
+			
+		case TAGFD_IOC_SETFLAGS:
+			if(get_user(flags, (uint32_t __user *)arg))
+				return -EFAULT;
+			if(flags & ~TAGFD_FLAGS_ALL)
+				return -EINVAL;
+			watcher->flags = flags;
+			return 0;
+			
+		case TAGFD_IOC_SETFILTER:
+			if(ectx == NULL)
+				return -EBADFD;
+			return tagfd_setFilter(watcher, ectx, arg);
+			
+		case TAGFD_IOC_SETQUEUE:
+			if(ectx == NULL)
+				return -EBADFD;
+			if(get_user(depth, (uint32_t __user *)arg))
+				return -EFAULT;
+			if(depth && ectx->array)
+				return -EOPNOTSUPP;
+			return tagfd_setQueue(watcher, ectx, depth);
+			
+		case TAGFD_IOC_SETAGGREGATE:
+			if(ectx == NULL)
+				return -EBADFD;
+			if(get_user(flags, (uint32_t __user *)arg))
+				return -EFAULT;
+			if(flags && ectx->array)
+				return -EOPNOTSUPP;
+			return tagfd_setAggregate(watcher, ectx, flags != 0);
+			
+		case TAGFD_IOC_WAITREAD:
+			if(ectx == NULL)
+				return -EBADFD;
+			return tagfd_waitRead(watcher, ectx, arg);
+			
+		case TAGFD_IOC_ARRAYSIZE:
+			if(ectx == NULL)
+				return -EBADFD;
+			return put_user(ectx->arrayBytes, (uint32_t __user *)arg);
+			
+		case TAGFD_IOC_CAS:
+		case TAGFD_IOC_FETCHADD:
+			if(ectx == NULL)
+				return -EBADFD;
+			return tagfd_atomicOp(watcher, ectx, cmd, arg);
+			
+		case TAGFD_IOC_GETOVERFLOW:
+			spin_lock(&watcher->qlock);
+			overflow = watcher->overflow;
+			watcher->overflow = 0;
+			spin_unlock(&watcher->qlock);
+			return put_user(overflow, (uint64_t __user *)arg);
+			
+		default:
+			return -ENOTTY;
+	}
+}
+
+
+struct file_operations tagfd_tag_ctx_fops = {
+	.owner = THIS_MODULE,
+	.open = tagfd_open,
+	.release = tagfd_release,
+	.read_iter = tagfd_readIter,
+	.write_iter = tagfd_writeIter,
+	.mmap = tagfd_mmap,
+	.poll = tagfd_poll,
+	.unlocked_ioctl = tagfd_ioctl,
+};
+
+// /dev/tagfd.tag: the same as a tag, once it's bound to one.
+struct file_operations tagfd_bindFOps = {
+	.owner = THIS_MODULE,
+	.open = tagfd_bindOpen,
+	.release = tagfd_release,
+	.read_iter = tagfd_readIter,
+	.write_iter = tagfd_writeIter,
+	.mmap = tagfd_mmap,
+	.poll = tagfd_poll,
+	.unlocked_ioctl = tagfd_ioctl,
+};
+
+
+// -----------------------------------------
+// Timer tags
+// -----------------------------------------
+
+static enum hrtimer_restart
+tagfd_timerTick(struct hrtimer * hrt)
+{
+	struct tag_timer * tmr = container_of(hrt, struct tag_timer, hrt);
+	u64 ticks = hrtimer_forward_now(hrt, ns_to_ktime(tmr->period_ns));
+	
+	atomic64_add(ticks, &tmr->ticks);
+	queue_work(system_highpri_wq, &tmr->work);
+	return HRTIMER_RESTART;
+}
+
+// Adds the pending ticks to the tag, as a fetch-add (so that it doesn't race with 
+// anybody else writing the tag). It's timestamped under the tag's lock, like a 
+// TAGFD_FLAG_KERNELTIME write, so another write can't get in first with a later time. 
+static void
+tagfd_timerWork(struct work_struct * work)
+{
+	struct tag_timer * tmr = container_of(work, struct tag_timer, work);
+	struct tag_ctx * ectx = tmr->e_ctx;
+	struct tag_fetchadd add;
+	
+	memset(&add, 0, sizeof(add));
+	add.delta = atomic64_xchg(&tmr->ticks, 0);
+	if(add.delta == 0)
+		return;
+	
+	add.tag.tag.dtype = ectx->tag.dtype;
+	add.tag.tag.quality = QUALITY_GOOD;
+	
+	// if it's rejected anyway (the tag being retyped under us), keep the ticks for next time
+	if(tagfd_writeTag(ectx, &add.tag, TAGFD_FLAG_KERNELTIME, tagfd_addModify, &add) < 0)
+		atomic64_add(add.delta, &tmr->ticks);
+}
+
+static struct tag_timer *
+tagfd_newTimer(u64 period_ns)
+{
+	struct tag_timer * tmr = kzalloc(sizeof(struct tag_timer), GFP_KERNEL);
+	if(tmr == NULL)
+		return NULL;
+	
+	tmr->period_ns = period_ns;
+	hrtimer_init(&tmr->hrt, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	tmr->hrt.function = tagfd_timerTick;
+	INIT_WORK(&tmr->work, tagfd_timerWork);
+	return tmr;
+}
+
+// Starts a timer tag ticking. 
+static void
+tagfd_startTimer(struct tag_ctx * ectx, struct tag_timer * tmr)
+{
+	tmr->e_ctx = ectx;
+	ectx->timer = tmr;
+	hrtimer_start(&tmr->hrt, ns_to_ktime(tmr->period_ns), HRTIMER_MODE_REL);
+}
+
+// Stops a timer tag ticking, for good. 
+static void
+tagfd_cancelTimer(struct tag_timer * tmr)
+{
+	hrtimer_cancel(&tmr->hrt);
+	cancel_work_sync(&tmr->work);
+}
+
+static void
+tagfd_stopTimer(struct tag_timer * tmr)
+{
+	tagfd_cancelTimer(tmr);
+	kfree(tmr);
+}
+
+
+
+
+// -----------------------------------------
+// Constructor and destructor for struct tag_ctx
+// -----------------------------------------
+
+
+// constructor 
+// ectx is either zeroed, or a deleted tag whose slot is being reused (see tagfd_allocTag).
+
+static int 
+tagfd_construct_tag(struct tag_ctx * ectx, int id, struct class * class, tag_t ent, u64 timestamp_ns, const char * name)
+{
+	int err = 0;
+	dev_t devno = MKDEV(MAJOR(gl_dev),tagfd_tagMinor(id));
+	struct device * device = NULL;
+	
+	if(!ectx->deleted)
+	{
+		ectx->id = id;
+		ectx->shm = tagfd_tablePage(id / TABLE_ENTRIES_PER_PAGE);
+		if(ectx->shm == NULL)
+			return -ENOMEM;
+		ectx->shm += id % TABLE_ENTRIES_PER_PAGE;
+		
+		// Rest of context initialization
+		spin_lock_init(&ectx->lock);
+		seqcount_init(&ectx->seq);
+		INIT_LIST_HEAD(&ectx->subs);
+		INIT_LIST_HEAD(&ectx->queues);
+		INIT_LIST_HEAD(&ectx->aggs);
+		INIT_LIST_HEAD(&ectx->deletedNode);
+		init_waitqueue_head(&ectx->wqh);
+		mutex_init(&ectx->arrayMtx);
+	}
+	
+	if(!nodev)
+	{
+		// The VFS holds on to a cdev until the last file opened through it is done with it,
+		// which can be after the tag was deleted and its slot given to this one. So the cdev
+		// isn't embedded: a deleted tag's is freed when its last reference is put. 
+		ectx->cdev = cdev_alloc();
+		if(ectx->cdev == NULL)
+			return -ENOMEM;
+		ectx->cdev->ops = &tagfd_tag_ctx_fops;
+		ectx->cdev->owner = THIS_MODULE;
+		err = cdev_add(ectx->cdev, devno, 1);
+		if(err)
+		{
+			printk(KERN_WARNING "tagfd: Error %d while trying to add device %s\n", err, name);
+			kobject_put(&ectx->cdev->kobj);
+			return err;
+		}
+		
+		device = device_create(class, NULL, devno, NULL, name);
+		if(IS_ERR(device))
+		{
+			err = PTR_ERR(device);
+			printk(KERN_WARNING "tagfd: Error %d while trying to create %s\n", err, name);
+			cdev_del(ectx->cdev);
+			return err;
+		}
+	}
+	
+	// Nobody can have it open yet, but lookups by ID that started before a reused slot's
+	// tag was deleted can still be looking at it, so it's set up like a write. 
+	spin_lock(&ectx->lock);
+	write_seqcount_begin(&ectx->seq);
+	ectx->tag = ent;
+	ectx->generation++; // (to 1 for a new tag) so that it reads as new to watchers, who start at zero
+	ectx->timestamp_ns = timestamp_ns;
+	write_seqcount_end(&ectx->seq);
+	memset(ectx->name, 0, sizeof(ectx->name));
+	strncpy(ectx->name, name, TAG_NAME_LENGTH-1);
+	tagfd_publish(ectx);
+	if(ectx->array)
+		tagfd_arrayPublish(ectx, false);
+	WRITE_ONCE(ectx->deleted, false);
+	spin_unlock(&ectx->lock);
+	
+	return 0;
+}
+
+
+// destructor
+static void
+tagfd_destruct_tag(struct tag_ctx * ectx, struct class * class)
+{
+	if(ectx->timer)
+		tagfd_stopTimer(ectx->timer);
+	// a deleted tag's device is already gone
+	if(!nodev && !ectx->deleted)
+	{
+		device_destroy(class, MKDEV(MAJOR(gl_dev), tagfd_tagMinor(ectx->id)));
+		cdev_del(ectx->cdev);
+	}
+	vfree(ectx->array);
+	// wait queue?
+}
+
+
+
+
+// -----------------------------------------
+// Master device file ops 
+// -----------------------------------------
+
+
+static int 
+tagfd_masterOpen(struct inode * inode, struct file * filp)
+{
+	if(! atomic_dec_and_test(&gl_masterAvailable))
+	{
+		atomic_inc(&gl_masterAvailable);
+		return -EBUSY;
+	}
+	filp->private_data = inode->i_cdev;
+	return 0;
+}
+
+static int
+tagfd_masterRelease(struct inode * inode, struct file * filp)
+{
+	atomic_inc(&gl_masterAvailable);
+	return 0;
+}
+
+
+// Whether nothing refers to a deleted tag any more (no open files or subscriptions), so that
+// its slot can be reused. Call with gl_tagsMtx held.
+static bool
+tagfd_tagIdle(struct tag_ctx * ectx)
+{
+	bool idle;
+	
+	if(atomic_read(&ectx->stats.watchers))
+		return false;
+	spin_lock(&ectx->lock);
+	idle = list_empty(&ectx->subs);
+	spin_unlock(&ectx->lock);
+	return idle;
+}
+
+// Gets a deleted tag's slot ready for a new tag. Its timer was already cancelled when it 
+// was deleted, and nothing can be using its array, since nothing has it open. 
+static void
+tagfd_recycleTag(struct tag_ctx * ectx)
+{
+	if(ectx->timer)
+		tagfd_stopTimer(ectx->timer);
+	vfree(ectx->array);
+	
+	spin_lock(&ectx->lock);
+	ectx->timer = NULL;
+	ectx->array = NULL;
+	ectx->arrayBytes = 0;
+	ectx->stats.writes = 0;
+	memset(ectx->stats.rejected, 0, sizeof(ectx->stats.rejected));
+	spin_unlock(&ectx->lock);
+	atomic64_set(&ectx->stats.reads, 0);
+	atomic64_set(&ectx->stats.wakeups, 0);
+}
+
+// Allocates a tag, and sets *id to its ID. Call with gl_tagsMtx held. Returns NULL if 
+// we're out of memory, or out of IDs (the ones below max_tags are all taken, by tags or 
+// by deleted tags that are still open). 
+// If a deleted tag's slot can be reused, its tag_ctx is returned, still marked deleted 
+// (tagfd_construct_tag brings it back). Otherwise the tag gets the next ID (gl_nEntities), 
+// and doesn't become visible to tagfd_getTag until gl_nEntities is incremented.
+static struct tag_ctx *
+tagfd_allocTag(int * id)
+{
+	struct tag_ctx *** chunk;
+	struct tag_ctx * ectx;
+	
+	if(!list_empty(&gl_deletedTags))
+	{
+		// Files are bound to tags (and names looked up) under rcu_read_lock, so after a grace
+		// period, anything that found a tag before it was deleted has been counted. Lookups 
+		// by ID that are still going can end up at the new tag, just as if they'd come later.
+		if(gl_deletedSync)
+		{
+			synchronize_rcu();
+			gl_deletedSync = false;
+		}
+		list_for_each_entry(ectx, &gl_deletedTags, deletedNode)
+		{
+			if(tagfd_tagIdle(ectx))
+			{
+				list_del_init(&ectx->deletedNode);
+				tagfd_recycleTag(ectx);
+				*id = ectx->id;
+				return ectx;
+			}
+		}
+	}
+	
+	*id = gl_nEntities;
+	if(*id >= max_tags)
+		return NULL;
+	chunk = &gl_tagChunks[*id / TAG_CHUNK_SIZE];
+	
+	if(*chunk == NULL)
+	{
+		*chunk = kcalloc(TAG_CHUNK_SIZE, sizeof(struct tag_ctx *), GFP_KERNEL);
+		if(*chunk == NULL)
+			return NULL;
+	}
+	
+	ectx = kzalloc(sizeof(struct tag_ctx), GFP_KERNEL);
+	(*chunk)[*id % TAG_CHUNK_SIZE] = ectx;
+	return ectx;
+}
+
+// Whether a data type can be used for a timer tag. 
+static bool
+tagfd_timerType(u8 dtype)
+{
+	switch(dtype)
+	{
+		case DT_UINT8 :
+		case DT_UINT16 :
+		case DT_UINT32 :
+		case DT_UINT64 :
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Whether a request to the master device creates a tag. 
+static inline bool
+tagfd_createAction(u8 action)
+{
+	return action == '+' || action == TAGFD_ACTION_TIMER || action == TAGFD_ACTION_ARRAY;
+}
+
+// Fetches one request (a struct tag_config, or a struct tag_timer_config or 
+// tag_array_config if its action is TAGFD_ACTION_TIMER or TAGFD_ACTION_ARRAY) from the 
+// start of buf into gl_configBuffer, and checks it against the tags as they are now. 
+// Returns the size of the request, or a negative error code. Call with gl_tagsMtx held. 
+static ssize_t
+tagfd_masterParse(const char __user *buf, size_t count)
+{
+	int result, i, namelen;
+	struct tag_ctx * ectx;
+	struct tag_config * econf = (struct tag_config*) gl_configBuffer;
+	struct tag_timer_config * tconf = (struct tag_timer_config*) gl_configBuffer;
+	struct tag_array_config * aconf = (struct tag_array_config*) gl_configBuffer;
+	size_t len = sizeof(struct tag_config);
+	
+	// Make sure their write request was big enough to be valid. 
+	if(count < sizeof(struct tag_config))
+	{
+		printk(KERN_WARNING "tagfd.master: Received write request with invalid count.\n");
+		return -EINVAL;
+	}
+	
+	// fetch the data from the user and make sure that the parameters they supplied are actually right. 
+	memset (gl_configBuffer, 0, sizeof(gl_configBuffer));
+	result = copy_from_user(gl_configBuffer, buf, sizeof(struct tag_config));
+	if(result)
+	{
+		printk(KERN_WARNING "tagfd.master: Could not fetch data from userspace.\n");
+		return -EFAULT;
+	}
+	
+	// check action
+	switch(econf->action)
+	{
+		case '+' :
+		case TAGFD_ACTION_TIMER :
+		case TAGFD_ACTION_ARRAY :
+		case TAGFD_ACTION_DELETE :
+		case TAGFD_ACTION_RETYPE :
+			break;
+		default:
+			printk(KERN_WARNING "tagfd.master: Received request with invalid action.\n");
+			return -EINVAL;
+	}
+	
+	// timer tags have a period too
+	if(econf->action == TAGFD_ACTION_TIMER)
+	{
+		len = sizeof(struct tag_timer_config);
+		if(count < len)
+		{
+			printk(KERN_WARNING "tagfd.master: Received timer creation request with invalid count.\n");
+			return -EINVAL;
+		}
+		if(copy_from_user(&tconf->period_ns, buf + offsetof(struct tag_timer_config, period_ns), sizeof(u64)))
+			return -EFAULT;
+		if(tconf->period_ns < TAGFD_TIMER_MIN_NS)
+		{
+			printk(KERN_WARNING "tagfd.master: Received timer creation request with too short a period.\n");
+			return -EINVAL;
+		}
+		if(!tagfd_timerType(econf->dtype))
+		{
+			printk(KERN_WARNING "tagfd.master: Timer tags must have an unsigned integer data type.\n");
+			return -EINVAL;
+		}
+	}
+	
+	// array tags have a length, and their elements have to have a fixed size 
+	// (the data type itself is checked below)
+	if(econf->action == TAGFD_ACTION_ARRAY)
+	{
+		len = sizeof(struct tag_array_config);
+		if(count < len)
+		{
+			printk(KERN_WARNING "tagfd.master: Received array creation request with invalid count.\n");
+			return -EINVAL;
+		}
+		if(copy_from_user(&aconf->length, buf + offsetof(struct tag_array_config, length), sizeof(u32)))
+			return -EFAULT;
+		if(econf->dtype == DT_STRING || aconf->length == 0 ||
+		   aconf->length > TAGFD_ARRAY_MAX_BYTES / tagfd_valueSize(econf->dtype))
+		{
+			printk(KERN_WARNING "tagfd.master: Received array creation request with invalid data type or length.\n");
+			return -EINVAL;
+		}
+	}
+	
+	// check data type
+	switch(econf->dtype)
+	{
+		case DT_INT8 :
+		case DT_UINT8 :
+		case DT_INT16 :
+		case DT_UINT16 :
+		case DT_INT32 :
+		case DT_UINT32 :
+		case DT_INT64 :
+		case DT_UINT64 :
+		case DT_REAL32 :
+		case DT_REAL64 :
+		case DT_TIMESTAMP :
+		case DT_STRING :
+			break;
+		default:
+			// (deletes don't need one)
+			if(econf->action == TAGFD_ACTION_DELETE)
+				break;
+			printk(KERN_WARNING "tagfd.master: Received tag creation request with invalid datatype.\n");
+			return -EINVAL;
+			
+	}
+	
+	// check that the name is null terminated. 
+	if(econf->name[TAG_NAME_LENGTH-1] != 0)
+	{
+		printk(KERN_WARNING "tagfd.master: Received tag creation request with invalid name (not null-terminated).\n");
+		//print_hex_dump_bytes("", DUMP_PREFIX_NONE, econf, sizeof(struct tag_config));
+		return -EINVAL;
+	}
+
+	// check if the name is empty.
+	namelen = strlen(econf->name);
+	if(namelen == 0)
+	{
+		printk(KERN_WARNING "tagfd.master: Received tag creation request with empty name.\n");
+		return -EINVAL;
+	}
+	
+	// check if the name contains only allowed characters. 
+	for(i=0; i < namelen;i++)
+	{
+		if(!strchr(validTagNameChars,econf->name[i]))
+		{
+			printk(KERN_WARNING "tagfd.master: Received tag creation request with invalid name: %s\n",econf->name);
+			return -EINVAL;
+		}			
+	}
+	
+	// new tags need a name that isn't taken, the rest need a tag that exists.
+	ectx = tagfd_findByName(econf->name, namelen);
+	if(tagfd_createAction(econf->action))
+	{
+		if(ectx)
+		{
+			printk(KERN_WARNING "tagfd.master: Received tag creation request but name already exists: %s\n",econf->name);
+			return -EEXIST ;
+		}
+	}
+	else if(ectx == NULL)
+	{
+		printk(KERN_WARNING "tagfd.master: Received request for a tag that doesn't exist: %s\n",econf->name);
+		return -ENOENT ;
+	}
+	else if(econf->action == TAGFD_ACTION_RETYPE && ectx->timer && !tagfd_timerType(econf->dtype))
+	{
+		printk(KERN_WARNING "tagfd.master: Timer tags must have an unsigned integer data type.\n");
+		return -EINVAL;
+	}
+	else if(econf->action == TAGFD_ACTION_RETYPE && ectx->array)
+	{
+		printk(KERN_WARNING "tagfd.master: Array tags can't be retyped: %s\n", econf->name);
+		return -EOPNOTSUPP;
+	}
+	
+	return len;
+}
+
+// Creates a tag from the request in gl_configBuffer (see tagfd_masterParse). Call with 
+// gl_tagsMtx held. 
+static int
+tagfd_masterCreate(void)
+{
+	int result, err, namelen, id;
+	struct tag_ctx * ectx;
+	struct tag_timer * tmr = NULL;
+	struct tag_array_shm * array = NULL;
+	u32 arrayBytes = 0;
+	tag_t ent;
+	u64 now = ktime_get_real_ns();
+	struct tag_config * econf = (struct tag_config*) gl_configBuffer;
+	struct tag_timer_config * tconf = (struct tag_timer_config*) gl_configBuffer;
+	struct tag_array_config * aconf = (struct tag_array_config*) gl_configBuffer;
+	
+	// make sure there is space for us to add a new tag
+	if(gl_nTags >= max_tags)
+	{
+		printk(KERN_WARNING "tagfd.master: Received tag creation request, but already at maximum number of tags.\n");
+		return -ENOMEM;
+	}
+	
+	// set up tag
+	memset(&ent,0,sizeof(tag_t));
+	
+	ent.timestamp = div_u64(now, NSEC_PER_MSEC);
+	ent.quality = QUALITY_UNCERTAIN;
+	ent.dtype = econf->dtype;
+	namelen = strlen(econf->name);
+	
+	// good to go!
+	memset(gl_newNameBuffer,0,sizeof(gl_newNameBuffer));
+	result = snprintf(gl_newNameBuffer, sizeof(gl_newNameBuffer), "%s%s", PREFIX, econf->name);
+	if(result < 0 || result == sizeof(gl_newNameBuffer))
+	{
+		printk(KERN_WARNING "tagfd.master: Failed to snprintf device path for: %s\n",econf->name);
+		return -ENOTRECOVERABLE ;
+	}
+	
+	if(econf->action == TAGFD_ACTION_TIMER)
+	{
+		tmr = tagfd_newTimer(tconf->period_ns);
+		if(tmr == NULL)
+			return -ENOMEM;
+	}
+	
+	// an array tag's value is its length, and the elements live in their own pages, 
+	// so that they can be mapped. There are two copies of them, see tagfd_writeArray.
+	if(econf->action == TAGFD_ACTION_ARRAY)
+	{
+		ent.dtype = DT_ARRAY | econf->dtype;
+		ent.value.u32 = aconf->length;
+		arrayBytes = aconf->length * tagfd_valueSize(econf->dtype);
+		array = vmalloc_user(PAGE_ALIGN(sizeof(struct tag_array_shm) + 2 * (size_t)arrayBytes));
+		if(array == NULL)
+			return -ENOMEM;
+		array->length = aconf->length;
+		array->element_size = tagfd_valueSize(econf->dtype);
+	}
+	
+	ectx = tagfd_allocTag(&id);
+	if(ectx == NULL)
+	{
+		printk(KERN_WARNING "tagfd.master: Failed to allocate tag (or every ID is taken by deleted tags that are still open): %s\n",econf->name);
+		kfree(tmr);
+		vfree(array);
+		return -ENOMEM;
+	}
+	ectx->array = array;
+	ectx->arrayBytes = arrayBytes;
+	
+	err = tagfd_construct_tag(ectx, id, gl_tagfdClass ,ent, now, gl_newNameBuffer);
+	if(err)
+	{
+		printk(KERN_WARNING "tagfd.master: Failed to create tag at: %s\n",gl_newNameBuffer);
+		kfree(tmr);
+		vfree(array);
+		if(id < gl_nEntities)
+		{
+			// a reused slot goes back to being deleted
+			ectx->array = NULL;
+			ectx->arrayBytes = 0;
+			list_add(&ectx->deletedNode, &gl_deletedTags);
+		}
+		else
+		{
+			kfree(ectx);
+			gl_tagChunks[id / TAG_CHUNK_SIZE][id % TAG_CHUNK_SIZE] = NULL;
+		}
+		return err ;
+	}
+	// publish the new tag to tagfd_getTag, then to name lookups
+	if(id == gl_nEntities)
+		smp_store_release(&gl_nEntities, gl_nEntities + 1);
+	gl_nTags++;
+	ectx->nameHash = jhash(econf->name, namelen, 0);
+	hash_add_rcu(gl_nameIndex, &ectx->nameNode, ectx->nameHash);
+	
+	if(tmr)
+		tagfd_startTimer(ectx, tmr);
+	
+	return 0;
+}	
+
+// Deletes a tag. Call with gl_tagsMtx held. 
+// The tag_ctx isn't freed until the module is unloaded: open files, subscriptions and 
+// lookups by ID can all still be holding it. Once nothing refers to it, its slot (and ID) 
+// is given to the next tag created, see tagfd_allocTag.
+static void
+tagfd_masterDelete(struct tag_ctx * ectx)
+{
+	struct tag_sub * sub;
+	u64 locked;
+	
+	// no more lookups by name, or timer ticks
+	hash_del_rcu(&ectx->nameNode);
+	if(ectx->timer)
+		tagfd_cancelTimer(ectx->timer);
+	
+	// from here on, writes are rejected, and the table and subscribers see DT_INVALID.
+	locked = tagfd_lockWrite(ectx);
+	WRITE_ONCE(ectx->deleted, true);
+	write_seqcount_begin(&ectx->seq);
+	ectx->tag.dtype = DT_INVALID;
+	ectx->generation++;
+	write_seqcount_end(&ectx->seq);
+	tagfd_publish(ectx);
+	if(ectx->array)
+		tagfd_arrayPublish(ectx, false);
+	list_for_each_entry(sub, &ectx->subs, tagNode)
+		tagfd_subNotify(sub);
+	tagfd_unlockWrite(ectx, locked);
+	
+	// readers that are waiting get -EIDRM
+	wake_up_interruptible(&ectx->wqh);
+	
+	if(!nodev)
+	{
+		device_destroy(gl_tagfdClass, MKDEV(MAJOR(gl_dev), tagfd_tagMinor(ectx->id)));
+		cdev_del(ectx->cdev);
+	}
+	
+	list_add_tail(&ectx->deletedNode, &gl_deletedTags);
+	gl_deletedSync = true;
+	gl_nTags--;
+}
+
+// Changes a tag's data type. The value is reset to zero, with uncertain quality, written 
+// like any other value (so readers, subscribers and the journal all see it). 
+static void
+tagfd_masterRetype(struct tag_ctx * ectx, u8 dtype)
+{
+	tagx_t tmp;
+	bool journaled;
+	u64 locked;
+	
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.tag.dtype = dtype;
+	tmp.tag.quality = QUALITY_UNCERTAIN;
+	
+	locked = tagfd_lockWrite(ectx);
+	tagfd_stampWrite(ectx, &tmp);
+	journaled = tagfd_commitWrite(ectx, &tmp, true, false);
+	tagfd_unlockWrite(ectx, locked);
+	
+	tagfd_wakeWaiters(ectx, journaled);
+}
+
+// Carries out the request in gl_configBuffer (see tagfd_masterParse). Call with gl_tagsMtx held. 
+static int
+tagfd_masterApply(void)
+{
+	struct tag_config * econf = (struct tag_config*) gl_configBuffer;
+	struct tag_ctx * ectx;
+	
+	if(tagfd_createAction(econf->action))
+		return tagfd_masterCreate();
+	
+	ectx = tagfd_findByName(econf->name, strlen(econf->name));
+	if(ectx == NULL)
+		return -ENOENT;
+	if(econf->action == TAGFD_ACTION_DELETE)
+		tagfd_masterDelete(ectx);
+	else
+		tagfd_masterRetype(ectx, econf->dtype);
+	return 0;
+}
+
+// A write can hold any number of requests back to back. They are all checked (against the
+// tags as they were before the write) before any is carried out, so a bad one fails the 
+// whole write with nothing done. If one fails anyway (e.g. the same name twice in one 
+// write, or no memory), the write stops there, and returns how much of it was consumed 
+// if that's anything. 
+// Nothing but the master device takes gl_tagsMtx, so this never holds up tags' readers or writers.
+static ssize_t
+tagfd_masterWrite(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+	ssize_t len, done, ret = 0;
+	size_t ntags = 0;
+	int err;
+	
+	if(mutex_lock_interruptible(&gl_tagsMtx))
+		return -ERESTARTSYS;
+	
+	for(done = 0; done < count; done += len)
+	{
+		len = tagfd_masterParse(buf + done, count - done);
+		if(len < 0)
+		{
+			ret = len;
+			goto out;
+		}
+		if(tagfd_createAction(((struct tag_config*) gl_configBuffer)->action))
+			ntags++;
+	}
+	if(gl_nTags + ntags > max_tags)
+	{
+		printk(KERN_WARNING "tagfd.master: Received request for %zu tags, but that would exceed the maximum number of tags.\n", ntags);
+		ret = -ENOMEM;
+		goto out;
+	}
+	
+	for(done = 0; done < count; done += len)
+	{
+		len = tagfd_masterParse(buf + done, count - done);
+		if(len >= 0 && (err = tagfd_masterApply()))
+			len = err;
+		if(len < 0)
+		{
+			ret = done ? done : len;
+			goto out;
+		}
+	}
+	ret = done;
+	
+out:
+	mutex_unlock(&gl_tagsMtx);
+	return ret;
+}
+
+
+struct file_operations tagfd_masterFOps = {
+	.owner = THIS_MODULE,
+	.write = tagfd_masterWrite,
+	.open = tagfd_masterOpen,
+	.release = tagfd_masterRelease,
+};
+
+
+
+
+// -----------------------------------------
+// Table device file ops 
+// -----------------------------------------
+
+// Pages of the table are mapped in as they're touched. Only pages that can hold 
+// tags (given the current max_tags) can be touched, the rest of the mapping is 
+// there for when max_tags grows. 
+static vm_fault_t
+tagfd_tableFault(struct vm_fault *vmf)
+{
+	struct tag_shm_entry * page;
+	unsigned long usable = DIV_ROUND_UP((unsigned long)READ_ONCE(max_tags), TABLE_ENTRIES_PER_PAGE);
+	
+	if(vmf->pgoff >= usable)
+		return VM_FAULT_SIGBUS;
+	
+	page = tagfd_tablePage(vmf->pgoff);
+	if(page == NULL)
+		return VM_FAULT_OOM;
+	
+	vmf->page = virt_to_page(page);
+	get_page(vmf->page);
+	return 0;
+}
+
+static const struct vm_operations_struct tagfd_tableVmOps = {
+	.fault = tagfd_tableFault,
+};
+
+static int
+tagfd_tableMmap(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long npages = vma_pages(vma);
+	
+	// The table is read-only for userspace. 
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	
+	if(vma->vm_pgoff >= TABLE_NPAGES || npages > TABLE_NPAGES - vma->vm_pgoff)
+		return -EINVAL;
+	
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_ops = &tagfd_tableVmOps;
+	return 0;
+}
+
+static long
+tagfd_tableIoctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	switch(cmd)
+	{
+		case TAGFD_IOC_CAPACITY:
+			return put_user((uint32_t)READ_ONCE(max_tags), (uint32_t __user *)arg);
+			
+		default:
+			return -ENOTTY;
+	}
+}
+
+struct file_operations tagfd_tableFOps = {
+	.owner = THIS_MODULE,
+	.mmap = tagfd_tableMmap,
+	.unlocked_ioctl = tagfd_tableIoctl,
+};
+
+
+
+
+// -----------------------------------------
+// Subscription device file ops 
+// -----------------------------------------
+
+static int 
+tagfd_subOpen(struct inode * inode, struct file * filp)
+{
+	struct tag_subscriber * subr = kmalloc(sizeof(struct tag_subscriber), GFP_KERNEL);
+	if(subr == NULL)
+	{
+		return -ENOMEM;
+	}
+	
+	mutex_init(&subr->mtx);
+	spin_lock_init(&subr->lock);
+	INIT_LIST_HEAD(&subr->subs);
+	INIT_LIST_HEAD(&subr->ready);
+	init_waitqueue_head(&subr->wqh);
+	
+	filp->private_data = subr;
+	return 0;
+}
+
+// Unhooks a subscription from its tag and frees it. Call with the owner's mutex held.
+static void
+tagfd_subRemove(struct tag_sub * sub)
+{
+	struct tag_subscriber * subr = sub->owner;
+	
+	spin_lock(&sub->e_ctx->lock);
+	list_del(&sub->tagNode);
+	spin_unlock(&sub->e_ctx->lock);
+	
+	spin_lock(&subr->lock);
+	list_del_init(&sub->readyNode);
+	spin_unlock(&subr->lock);
+	
+	list_del(&sub->ownerNode);
+	kfree(sub);
+}
+
+static int
+tagfd_subRelease(struct inode * inode, struct file * filp)
+{
+	struct tag_subscriber * subr = filp->private_data;
+	struct tag_sub * sub, * next;
+	
+	mutex_lock(&subr->mtx);
+	list_for_each_entry_safe(sub, next, &subr->subs, ownerNode)
+		tagfd_subRemove(sub);
+	mutex_unlock(&subr->mtx);
+	
+	mutex_destroy(&subr->mtx);
+	kfree(subr);
+	return 0;
+}
+
+static bool
+tagfd_subHasChanges(struct tag_subscriber * subr)
+{
+	bool ret;
+	
+	spin_lock(&subr->lock);
+	ret = !list_empty(&subr->ready);
+	spin_unlock(&subr->lock);
+	return ret;
+}
+
+// Reads as many change records as will fit in the user's buffer. 
+static ssize_t
+tagfd_subRead(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+	struct tag_subscriber * subr = filp->private_data;
+	struct tag_record rec;
+	struct tag_sub * sub;
+	size_t done = 0;
+	
+	if(count < sizeof(struct tag_record))
+		return -EINVAL;
+	
+	if(mutex_lock_interruptible(&subr->mtx))
+		return -ERESTARTSYS;
+	
+	// wait for something to report
+	while(!tagfd_subHasChanges(subr))
+	{
+		mutex_unlock(&subr->mtx);
+		
+		if(filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		
+		if(wait_event_interruptible(subr->wqh, tagfd_subHasChanges(subr)))
+			return -ERESTARTSYS;
+		
+		if(mutex_lock_interruptible(&subr->mtx))
+			return -ERESTARTSYS;
+	}
+	
+	memset(&rec, 0, sizeof(rec));
+	while(done + sizeof(struct tag_record) <= count)
+	{
+		// Take the next pending subscription off the ready list before taking 
+		// the snapshot, so a write that lands after the snapshot queues it again.
+		spin_lock(&subr->lock);
+		sub = list_first_entry_or_null(&subr->ready, struct tag_sub, readyNode);
+		if(sub)
+			list_del_init(&sub->readyNode);
+		spin_unlock(&subr->lock);
+		if(!sub)
+			break;
+		
+		rec.id = sub->e_ctx->id;
+		tagfd_readTag(sub->e_ctx, &rec.tag);
+		
+		if(copy_to_user(buf + done, &rec, sizeof(rec)))
+		{
+			// put it back, so the change isn't lost. 
+			spin_lock(&subr->lock);
+			if(list_empty(&sub->readyNode))
+				list_add(&sub->readyNode, &subr->ready);
+			spin_unlock(&subr->lock);
+			if(done == 0)
+			{
+				mutex_unlock(&subr->mtx);
+				return -EFAULT;
+			}
+			break;
+		}
+		done += sizeof(rec);
+	}
+	
+	mutex_unlock(&subr->mtx);
+	return done;
+}
+
+static unsigned int 
+tagfd_subPoll(struct file *filp, poll_table *wait)
+{
+	unsigned int mask = 0;
+	struct tag_subscriber * subr = filp->private_data;
+	
+	poll_wait(filp, &subr->wqh, wait);
+	smp_mb(); // pairs with wq_has_sleeper in tagfd_subNotify
+	if(tagfd_subHasChanges(subr))
+		mask |= POLLIN | POLLRDNORM;
+	return mask;
+}
+
+// Finds this subscriber's subscription to a tag. Call with the tag's lock held.
+static struct tag_sub *
+tagfd_subFind(struct tag_subscriber * subr, struct tag_ctx * ectx)
+{
+	struct tag_sub * sub;
+	
+	list_for_each_entry(sub, &ectx->subs, tagNode)
+	{
+		if(sub->owner == subr)
+			return sub;
+	}
+	return NULL;
+}
+
+static int
+tagfd_subscribe(struct tag_subscriber * subr, struct tag_ctx * ectx)
+{
+	struct tag_sub * sub = kmalloc(sizeof(struct tag_sub), GFP_KERNEL);
+	if(sub == NULL)
+		return -ENOMEM;
+	
+	sub->owner = subr;
+	sub->e_ctx = ectx;
+	INIT_LIST_HEAD(&sub->readyNode);
+	
+	spin_lock(&ectx->lock);
+	if(tagfd_subFind(subr, ectx))
+	{
+		spin_unlock(&ectx->lock);
+		kfree(sub);
+		return -EEXIST;
+	}
+	list_add_tail(&sub->tagNode, &ectx->subs);
+	list_add_tail(&sub->ownerNode, &subr->subs);
+	// report the current value straight away
+	tagfd_subNotify(sub);
+	spin_unlock(&ectx->lock);
+	
+	return 0;
+}
+
+static int
+tagfd_unsubscribe(struct tag_subscriber * subr, struct tag_ctx * ectx)
+{
+	struct tag_sub * sub;
+	
+	// The tag can only be removed from subs with the owner's mutex held, which we have, 
+	// so it's fine to drop the tag's lock before tagfd_subRemove takes it again.
+	spin_lock(&ectx->lock);
+	sub = tagfd_subFind(subr, ectx);
+	spin_unlock(&ectx->lock);
+	if(sub == NULL)
+		return -ENOENT;
+	
+	tagfd_subRemove(sub);
+	return 0;
+}
+
+static long
+tagfd_subIoctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct tag_subscriber * subr = filp->private_data;
+	struct tag_ctx * ectx;
+	uint32_t id;
+	int err;
+	
+	switch(cmd)
+	{
+		case TAGFD_IOC_SUBSCRIBE:
+		case TAGFD_IOC_UNSUBSCRIBE:
+			if(get_user(id, (uint32_t __user *)arg))
+				return -EFAULT;
+			ectx = tagfd_getTag(id);
+			if(ectx == NULL)
+				return -ENOENT;
+			
+			if(mutex_lock_interruptible(&subr->mtx))
+				return -ERESTARTSYS;
+			if(cmd == TAGFD_IOC_SUBSCRIBE)
+				err = tagfd_subscribe(subr, ectx);
+			else
+				err = tagfd_unsubscribe(subr, ectx);
+			mutex_unlock(&subr->mtx);
+			return err;
+			
+		default:
+			return -ENOTTY;
+	}
+}
+
+struct file_operations tagfd_subFOps = {
+	.owner = THIS_MODULE,
+	.open = tagfd_subOpen,
+	.release = tagfd_subRelease,
+	.read = tagfd_subRead,
+	.poll = tagfd_subPoll,
+	.unlocked_ioctl = tagfd_subIoctl,
+};
+
+
+
+
+// -----------------------------------------
+// Bulk device file ops 
+// -----------------------------------------
+
+// Reads or writes every entry of a struct tag_bulk, one at a time, 
+// storing each entry's status (and for reads, its value) back in the user's array. 
+static long
+tagfd_bulkTransfer(unsigned int cmd, unsigned long arg)
+{
+	struct tag_bulk req;
+	struct tag_bulk_entry ent;
+	struct tag_bulk_entry __user * uents;
+	struct tag_ctx * ectx;
+	u32 i;
+	
+	if(copy_from_user(&req, (void __user *)arg, sizeof(req)))
+		return -EFAULT;
+	if((req.flags & ~TAGFD_FLAGS_ALL) || req.count > INT_MAX)
+		return -EINVAL;
+	uents = u64_to_user_ptr(req.entries);
+	
+	for(i = 0; i < req.count; i++)
+	{
+		if(signal_pending(current))
+			return i ? i : -ERESTARTSYS;
+		
+		if(copy_from_user(&ent, &uents[i], sizeof(ent)))
+			return i ? i : -EFAULT;
+		
+		ectx = tagfd_getTag(ent.id);
+		if(ectx == NULL)
+		{
+			ent.status = -ENOENT;
+		}
+		else if(cmd == TAGFD_IOC_BULKREAD)
+		{
+			tagfd_readTag(ectx, &ent.tag);
+			ent.status = 0;
+		}
+		else
+		{
+			ent.status = tagfd_writeTag(ectx, &ent.tag, req.flags, NULL, NULL);
+		}
+		
+		if(copy_to_user(&uents[i], &ent, sizeof(ent)))
+			return i ? i : -EFAULT;
+	}
+	
+	return i;
+}
+
+static int
+tagfd_compareTags(const void * a, const void * b)
+{
+	const struct tag_ctx * x = *(struct tag_ctx * const *)a;
+	const struct tag_ctx * y = *(struct tag_ctx * const *)b;
+	
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+// Writes every entry of a struct tag_bulk as a single transaction: either all of 
+// the writes are made, or none are. The tags' locks are all taken (in ID order, 
+// under gl_txMtx) before anything is checked, and the writes are made inside a 
+// gl_txSeq write section, so snapshots see either all of them or none of them. 
+static long
+tagfd_bulkTxWrite(unsigned long arg)
+{
+	struct tag_bulk req;
+	struct tag_bulk_entry * ents = NULL;
+	struct tag_ctx ** tags = NULL, ** sorted = NULL;
+	bool extended, rejected = false, journaled = false;
+	long err = 0;
+	u32 i;
+	
+	if(copy_from_user(&req, (void __user *)arg, sizeof(req)))
+		return -EFAULT;
+	if(req.flags & ~TAGFD_FLAGS_ALL)
+		return -EINVAL;
+	if(req.count > TAGFD_TX_MAX)
+		return -E2BIG;
+	if(req.count == 0)
+		return 0;
+	extended = tagfd_extendedWrite(req.flags);
+	
+	ents = kmalloc_array(req.count, sizeof(*ents), GFP_KERNEL);
+	tags = kmalloc_array(req.count, sizeof(*tags), GFP_KERNEL);
+	sorted = kmalloc_array(req.count, sizeof(*sorted), GFP_KERNEL);
+	if(!ents || !tags || !sorted)
+	{
+		err = -ENOMEM;
+		goto out;
+	}
+	if(copy_from_user(ents, u64_to_user_ptr(req.entries), req.count * sizeof(*ents)))
+	{
+		err = -EFAULT;
+		goto out;
+	}
+	
+	for(i = 0; i < req.count; i++)
+	{
+		tags[i] = tagfd_getTag(ents[i].id);
+		ents[i].status = tags[i] ? 0 : -ENOENT;
+		if(!tags[i])
+			rejected = true;
+	}
+	if(rejected)
+		goto report;
+	
+	// A tag can only be written once per transaction (and its lock only taken once).
+	memcpy(sorted, tags, req.count * sizeof(*tags));
+	sort(sorted, req.count, sizeof(*sorted), tagfd_compareTags, NULL);
+	for(i = 1; i < req.count; i++)
+	{
+		if(sorted[i] == sorted[i-1])
+			rejected = true;
+	}
+	if(rejected)
+	{
+		for(i = 0; i < req.count; i++)
+			ents[i].status = -EINVAL;
+		goto report;
+	}
+	
+	if(mutex_lock_interruptible(&gl_txMtx))
+	{
+		err = -ERESTARTSYS;
+		goto out;
+	}
+	for(i = 0; i < req.count; i++)
+		spin_lock_nest_lock(&sorted[i]->lock, &gl_txMtx);
+	
+	for(i = 0; i < req.count; i++)
+	{
+		if(req.flags & TAGFD_FLAG_KERNELTIME)
+			tagfd_stampWrite(tags[i], &ents[i].tag);
+		ents[i].status = tagfd_checkWrite(tags[i], &ents[i].tag, extended, false);
+		if(ents[i].status)
+		{
+			tagfd_rejectWrite(tags[i], ents[i].status);
+			rejected = true;
+		}
+	}
+	
+	if(!rejected)
+	{
+		write_seqcount_begin(&gl_txSeq);
+		for(i = 0; i < req.count; i++)
+			journaled |= tagfd_commitWrite(tags[i], &ents[i].tag, extended, false);
+		write_seqcount_end(&gl_txSeq);
+	}
+	
+	for(i = req.count; i > 0; i--)
+		spin_unlock(&sorted[i-1]->lock);
+	mutex_unlock(&gl_txMtx);
+	
+	if(!rejected)
+	{
+		for(i = 0; i < req.count; i++)
+			tagfd_wakeWaiters(tags[i], false);
+		if(journaled)
+			tagfd_wakeJournal();
+	}
+	
+	report:
+	// entries that were fine, but weren't written because others weren't
+	if(rejected)
+	{
+		err = -ECANCELED;
+		for(i = 0; i < req.count; i++)
+		{
+			if(ents[i].status == 0)
+				ents[i].status = -ECANCELED;
+		}
+	}
+	if(copy_to_user(u64_to_user_ptr(req.entries), ents, req.count * sizeof(*ents)))
+		err = -EFAULT;
+	
+	out:
+	kfree(sorted);
+	kfree(tags);
+	kfree(ents);
+	return err;
+}
 
-static int 
-tagfd_construct_tag(struct tag_ctx * ectx, int minor, struct class * class, tag_t ent, const char * name)
+// Reads every entry of a struct tag_bulk, such that no transaction is seen half done. 
+static long
+tagfd_bulkSnapshot(unsigned long arg)
 {
-	int err = 0;
-	dev_t devno = MKDEV(MAJOR(gl_dev),minor);
-	struct device * device = NULL;
-	
-	ectx->tag = ent;
-	strncpy(ectx->name, name, TAG_NAME_LENGTH-1);
+	struct tag_bulk req;
+	struct tag_bulk_entry * ents;
+	struct tag_ctx * ectx;
+	unsigned seq;
+	long err = 0;
+	u32 i;
 	
-	// Rest of context initialization
-	mutex_init(&ectx->mtx);
-	cdev_init(&ectx->cdev, &tagfd_tag_ctx_fops);
-	ectx->cdev.owner = THIS_MODULE;
-	init_waitqueue_head(&ectx->wqh);
+	if(copy_from_user(&req, (void __user *)arg, sizeof(req)))
+		return -EFAULT;
+	if(req.flags & ~TAGFD_FLAGS_ALL)
+		return -EINVAL;
+	if(req.count > TAGFD_TAGS_LIMIT)
+		return -E2BIG;
+	if(req.count == 0)
+		return 0;
 	
-	err = cdev_add(&ectx->cdev, devno, 1);
-	if(err)
+	ents = kvmalloc_array(req.count, sizeof(*ents), GFP_KERNEL);
+	if(!ents)
+		return -ENOMEM;
+	if(copy_from_user(ents, u64_to_user_ptr(req.entries), req.count * sizeof(*ents)))
 	{
-		printk(KERN_WARNING "tagfd: Error %d while trying to add device %s\n", err, name);
-		mutex_destroy(&ectx->mtx);
-		return err;
+		err = -EFAULT;
+		goto out;
 	}
 	
-	device = device_create(class, NULL, devno, NULL, name);
-	if(IS_ERR(device))
+	// Readers don't hold anything up: if a transaction was committed while we were 
+	// reading, just read everything again.
+	do
 	{
-		err = PTR_ERR(device);
-		printk(KERN_WARNING "tagfd: Error %d while trying to create %s\n", err, name);
-		mutex_destroy(&ectx->mtx);
-		cdev_del(&ectx->cdev);
-		return err;
-	}
+		if(signal_pending(current))
+		{
+			err = -ERESTARTSYS;
+			goto out;
+		}
+		
+		seq = read_seqcount_begin(&gl_txSeq);
+		for(i = 0; i < req.count; i++)
+		{
+			ectx = tagfd_getTag(ents[i].id);
+			ents[i].status = ectx ? 0 : -ENOENT;
+			if(ectx)
+				tagfd_readTag(ectx, &ents[i].tag);
+		}
+	} while(read_seqcount_retry(&gl_txSeq, seq));
 	
-	return 0;
+	if(copy_to_user(u64_to_user_ptr(req.entries), ents, req.count * sizeof(*ents)))
+		err = -EFAULT;
+	
+	out:
+	kvfree(ents);
+	return err;
 }
 
+// Resolves a tag name to an ID.
+static long
+tagfd_bulkLookup(unsigned long arg)
+{
+	struct tag_lookup __user * ureq = (struct tag_lookup __user *)arg;
+	struct tag_ctx * ectx = tagfd_findByUserName(ureq->name);
+	
+	if(IS_ERR(ectx))
+		return PTR_ERR(ectx);
+	return put_user((uint32_t)ectx->id, &ureq->id);
+}
 
-// destructor
-static void
-tagfd_destruct_tag(struct tag_ctx * ectx, int minor, struct class * class)
+static long
+tagfd_bulkIoctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	device_destroy(class, MKDEV(MAJOR(gl_dev), minor));
-	cdev_del(&ectx->cdev);
-	mutex_destroy(&ectx->mtx);
-	// wait queue?
+	switch(cmd)
+	{
+		case TAGFD_IOC_BULKREAD:
+		case TAGFD_IOC_BULKWRITE:
+			return tagfd_bulkTransfer(cmd, arg);
+			
+		case TAGFD_IOC_LOOKUP:
+			return tagfd_bulkLookup(arg);
+			
+		case TAGFD_IOC_TXWRITE:
+			return tagfd_bulkTxWrite(arg);
+			
+		case TAGFD_IOC_SNAPSHOT:
+			return tagfd_bulkSnapshot(arg);
+			
+		default:
+			return -ENOTTY;
+	}
 }
 
+struct file_operations tagfd_bulkFOps = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = tagfd_bulkIoctl,
+};
+
 
 
 
 // -----------------------------------------
-// Master device file ops 
+// Journal device file ops 
 // -----------------------------------------
 
+// Each open journal device follows the journal from where it was when it was opened.
+// next and overflow are protected by gl_journalLock, and mtx serializes readers of the file.
+struct tag_journalReader
+{
+	struct mutex mtx;
+	u64 next;     // sequence number of the next change to read
+	u64 overflow; // changes lost because this reader fell too far behind
+};
 
 static int 
-tagfd_masterOpen(struct inode * inode, struct file * filp)
+tagfd_journalOpen(struct inode * inode, struct file * filp)
 {
-	if(! atomic_dec_and_test(&gl_masterAvailable))
-	{
-		atomic_inc(&gl_masterAvailable);
-		return -EBUSY;
-	}
-	filp->private_data = &gl_masterCdev;
+	struct tag_journalReader * rdr = kzalloc(sizeof(*rdr), GFP_KERNEL);
+	if(!rdr)
+		return -ENOMEM;
+	
+	mutex_init(&rdr->mtx);
+	atomic_inc(&gl_journalReaders);
+	spin_lock(&gl_journalLock);
+	rdr->next = gl_journalHead;
+	spin_unlock(&gl_journalLock);
+	
+	filp->private_data = rdr;
 	return 0;
 }
 
 static int
-tagfd_masterRelease(struct inode * inode, struct file * filp)
+tagfd_journalRelease(struct inode * inode, struct file * filp)
 {
-	atomic_inc(&gl_masterAvailable);
+	struct tag_journalReader * rdr = filp->private_data;
+	
+	atomic_dec(&gl_journalReaders);
+	mutex_destroy(&rdr->mtx);
+	kfree(rdr);
 	return 0;
 }
 
+static bool
+tagfd_journalPending(struct tag_journalReader * rdr)
+{
+	bool ret;
+	
+	spin_lock(&gl_journalLock);
+	ret = gl_journalHead != rdr->next;
+	spin_unlock(&gl_journalLock);
+	return ret;
+}
+
+// Number of journal entries copied out at a time.
+#define JOURNAL_READ_BATCH 8
 
+// Reads as many changes as will fit in the user's buffer, oldest first. 
+// If the reader has fallen behind by more than the size of the journal, 
+// it skips ahead to the oldest change still held (which shows up as a 
+// gap in the sequence numbers), and the changes skipped are counted.
 static ssize_t
-tagfd_masterWrite(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+tagfd_journalRead(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
 {
-	int result, err, i, namelen;
-	tag_t ent;
-	struct timespec ts;
-	struct tag_config * econf = (struct tag_config*) gl_configBuffer;
-	
-	// set up tag
-	memset(&ent,0,sizeof(tag_t));
-	getnstimeofday(&ts);
+	struct tag_journalReader * rdr = filp->private_data;
+	struct tag_journal_entry batch[JOURNAL_READ_BATCH];
+	size_t done = 0;
+	u32 i, n;
 	
-	ent.timestamp = ts.tv_sec;
-	ent.timestamp *= 1000;
-	ent.timestamp += ts.tv_nsec/1000000;
-	ent.quality = QUALITY_UNCERTAIN;
-	
-	// Make sure their write request was big enough to be valid. 
-	if(count < sizeof(struct tag_config))
-	{
-		printk(KERN_WARNING "tagfd.master: Received write request with invalid count.\n");
+	if(count < sizeof(struct tag_journal_entry))
 		return -EINVAL;
-	}
 	
-	// fetch the data from the user and make sure that the parameters they supplied are actually right. 
-	memset (gl_configBuffer, 0, sizeof(struct tag_config));
-	result = copy_from_user(gl_configBuffer, buf, sizeof(struct tag_config));
-	if(result)
-	{
-		printk(KERN_WARNING "tagfd.master: Could not fetch data from userspace.\n");
-		return -EFAULT;
-	}
+	// Threads sharing the file would otherwise get the same changes (or skip some).
+	if(mutex_lock_interruptible(&rdr->mtx))
+		return -ERESTARTSYS;
 	
-	// check action
-	if(econf->action != '+')
+	while(!tagfd_journalPending(rdr))
 	{
-		printk(KERN_WARNING "tagfd.master: Received request with invalid action.\n");
-		return -EINVAL;
+		mutex_unlock(&rdr->mtx);
+		
+		if(filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if(wait_event_interruptible(gl_journalWqh, tagfd_journalPending(rdr)))
+			return -ERESTARTSYS;
+		
+		if(mutex_lock_interruptible(&rdr->mtx))
+			return -ERESTARTSYS;
 	}
 	
-	// make sure there is space for us to add a new tag
-	if(gl_nEntities == max_tags)
+	while(done + sizeof(struct tag_journal_entry) <= count)
 	{
-		printk(KERN_WARNING "tagfd.master: Received tag creation request, but already at maximum number of tags.\n");
-		return -ENOMEM;
+		// Copy a batch out of the journal, so that we don't copy to userspace with the lock held.
+		spin_lock(&gl_journalLock);
+		if(gl_journalHead - rdr->next > journal_size)
+		{
+			rdr->overflow += gl_journalHead - journal_size - rdr->next;
+			rdr->next = gl_journalHead - journal_size;
+		}
+		n = min_t(u64, gl_journalHead - rdr->next, 
+		          min_t(size_t, JOURNAL_READ_BATCH, (count - done) / sizeof(struct tag_journal_entry)));
+		for(i = 0; i < n; i++)
+			batch[i] = gl_journal[(rdr->next + i) & (journal_size - 1)];
+		spin_unlock(&gl_journalLock);
+		
+		if(n == 0)
+			break;
+		
+		if(copy_to_user(buf + done, batch, n * sizeof(struct tag_journal_entry)))
+			break;
+		
+		done += n * sizeof(struct tag_journal_entry);
+		spin_lock(&gl_journalLock);
+		rdr->next += n;
+		spin_unlock(&gl_journalLock);
 	}
 	
+	mutex_unlock(&rdr->mtx);
+	// (there was at least one change to read, so nothing done means the copy faulted)
+	return done ? done : -EFAULT;
+}
+
+static unsigned int 
+tagfd_journalPoll(struct file *filp, poll_table *wait)
+{
+	unsigned int mask = 0;
+	struct tag_journalReader * rdr = filp->private_data;
 	
-	// check data type
-	switch(econf->dtype)
+	poll_wait(filp, &gl_journalWqh, wait);
+	smp_mb(); // pairs with wq_has_sleeper in tagfd_wakeJournal
+	if(tagfd_journalPending(rdr))
+		mask |= POLLIN | POLLRDNORM;
+	return mask;
+}
+
+static long
+tagfd_journalIoctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct tag_journalReader * rdr = filp->private_data;
+	uint64_t overflow;
+	
+	switch(cmd)
 	{
-		case DT_INT8 :
-		case DT_UINT8 :
-		case DT_INT16 :
-		case DT_UINT16 :
-		case DT_INT32 :
-		case DT_UINT32 :
-		case DT_INT64 :
-		case DT_UINT64 :
-		case DT_REAL32 :
-		case DT_REAL64 :
-		case DT_TIMESTAMP :
-		case DT_STRING :
-			break;
-		default:
-			printk(KERN_WARNING "tagfd.master: Received tag creation request with invalid datatype.\n");
-			return -EINVAL;
+		case TAGFD_IOC_GETOVERFLOW:
+			spin_lock(&gl_journalLock);
+			overflow = rdr->overflow;
+			rdr->overflow = 0;
+			spin_unlock(&gl_journalLock);
+			return put_user(overflow, (uint64_t __user *)arg);
 			
+		default:
+			return -ENOTTY;
 	}
-	// assign data type. 
-	ent.dtype = econf->dtype;
+}
 
+struct file_operations tagfd_journalFOps = {
+	.owner = THIS_MODULE,
+	.open = tagfd_journalOpen,
+	.release = tagfd_journalRelease,
+	.read = tagfd_journalRead,
+	.poll = tagfd_journalPoll,
+	.unlocked_ioctl = tagfd_journalIoctl,
+};
+
+
+
+
+// -----------------------------------------
+// /proc/tagfd files
+// -----------------------------------------
+
+// The files start with a header (see SEQ_START_TOKEN), then have a line per tag. 
+static void *
+tagfd_procStart(struct seq_file * m, loff_t * pos)
+{
+	struct tag_ctx * ectx;
 	
-	// check that the name is null terminated. 
-	if(econf->name[TAG_NAME_LENGTH-1] != 0)
+	if(*pos == 0)
+		return SEQ_START_TOKEN;
+	// skip over deleted tags
+	while(*pos <= TAGFD_TAGS_LIMIT && (ectx = tagfd_tagSlot(*pos - 1)) != NULL)
 	{
-		printk(KERN_WARNING "tagfd.master: Received tag creation request with invalid name (not null-terminated).\n");
-		//print_hex_dump_bytes("", DUMP_PREFIX_NONE, econf, sizeof(struct tag_config));
-		return -EINVAL;
+		if(!READ_ONCE(ectx->deleted))
+			return ectx;
+		(*pos)++;
 	}
+	return NULL;
+}
 
-	// check if the name is empty.
-	namelen = strlen(econf->name);
-	if(namelen == 0)
-	{
-		printk(KERN_WARNING "tagfd.master: Received tag creation request with empty name.\n");
-		return -EINVAL;
-	}
+static void *
+tagfd_procNext(struct seq_file * m, void * v, loff_t * pos)
+{
+	(*pos)++;
+	return tagfd_procStart(m, pos);
+}
+
+static void
+tagfd_procStop(struct seq_file * m, void * v)
+{
+}
+
+// Prints one of the histograms (given by its offset in struct tagfd_hists), summed over all CPUs.
+static void
+tagfd_statsHist(struct seq_file * m, const char * name, size_t offset)
+{
+	int b, cpu;
+	u64 sum;
 	
-	// check if the name contains only allowed characters. 
-	for(i=0; i < namelen;i++)
+	seq_printf(m, "%s", name);
+	for(b = 0; b < HIST_BUCKETS; b++)
 	{
-		if(!strchr(validTagNameChars,econf->name[i]))
-		{
-			printk(KERN_WARNING "tagfd.master: Received tag creation request with invalid name: %s\n",econf->name);
-			return -EINVAL;
-		}			
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += ((u64 *)((char *)&per_cpu(gl_hists, cpu) + offset))[b];
+		seq_printf(m, " %llu", sum);
 	}
+	seq_putc(m, '\n');
+}
+
+static int
+tagfd_statsShow(struct seq_file * m, void * v)
+{
+	struct tag_ctx * ectx = v;
 	
-	// check if the name is already taken.
-	if(tagfd_isNameTaken(econf->name, namelen))
+	if(v == SEQ_START_TOKEN)
 	{
-		printk(KERN_WARNING "tagfd.master: Received tag creation request but name already exists: %s\n",econf->name);
-		return -EEXIST ;
+		seq_printf(m, "# latency histograms (stats_timing), bucket n counts 2^n to 2^(n+1) ns\n");
+		tagfd_statsHist(m, "lock_wait",    offsetof(struct tagfd_hists, lockWait));
+		tagfd_statsHist(m, "lock_hold",    offsetof(struct tagfd_hists, lockHold));
+		tagfd_statsHist(m, "wake_latency", offsetof(struct tagfd_hists, wakeLatency));
+		seq_printf(m, "# id name writes rejected_eperm rejected_einval rejected_other reads wakeups watchers\n");
+		return 0;
 	}
 	
-	// good to go!
-	memset(gl_newNameBuffer,0,sizeof(gl_newNameBuffer));
-	result = snprintf(gl_newNameBuffer, sizeof(gl_newNameBuffer), "%s%s", PREFIX, econf->name);
-	if(result < 0 || result == sizeof(gl_newNameBuffer))
+	seq_printf(m, "%d %s %llu %llu %llu %llu %lld %lld %d\n", ectx->id, tagfd_tagName(ectx),
+	           READ_ONCE(ectx->stats.writes),
+	           READ_ONCE(ectx->stats.rejected[STAT_REJECT_PERM]),
+	           READ_ONCE(ectx->stats.rejected[STAT_REJECT_INVAL]),
+	           READ_ONCE(ectx->stats.rejected[STAT_REJECT_OTHER]),
+	           atomic64_read(&ectx->stats.reads),
+	           atomic64_read(&ectx->stats.wakeups),
+	           atomic_read(&ectx->stats.watchers));
+	return 0;
+}
+
+static const struct seq_operations tagfd_statsSeqOps = {
+	.start = tagfd_procStart,
+	.next  = tagfd_procNext,
+	.stop  = tagfd_procStop,
+	.show  = tagfd_statsShow,
+};
+
+// Prints a tag's value. There's no floating point in the kernel, so reals are printed 
+// as the hex of their bits. Strings are printed as they are, with newlines and 
+// backslashes escaped (as \ooo), and run to the end of the line.
+static void
+tagfd_printValue(struct seq_file * m, const tag_t * tag)
+{
+	char str[TAG_STRING_VALUE_LENGTH + 1];
+	
+	switch(tag->dtype)
 	{
-		printk(KERN_WARNING "tagfd.master: Failed to snprintf device path for: %s\n",econf->name);
-		return -ENOTRECOVERABLE ;
+		case DT_INT8:      seq_printf(m, "%d", tag->value.i8);              break;
+		case DT_UINT8:     seq_printf(m, "%u", tag->value.u8);              break;
+		case DT_INT16:     seq_printf(m, "%d", tag->value.i16);             break;
+		case DT_UINT16:    seq_printf(m, "%u", tag->value.u16);             break;
+		case DT_INT32:     seq_printf(m, "%d", tag->value.i32);             break;
+		case DT_UINT32:    seq_printf(m, "%u", tag->value.u32);             break;
+		case DT_INT64:     seq_printf(m, "%lld", (long long)tag->value.i64); break;
+		case DT_UINT64:    seq_printf(m, "%llu", tag->value.u64);           break;
+		case DT_REAL32:    seq_printf(m, "0x%08x", tag->value.u32);         break;
+		case DT_REAL64:    seq_printf(m, "0x%016llx", tag->value.u64);      break;
+		case DT_TIMESTAMP: seq_printf(m, "%llu", tag->value.timestamp);     break;
+		case DT_STRING:
+			memcpy(str, tag->value.string, TAG_STRING_VALUE_LENGTH);
+			str[TAG_STRING_VALUE_LENGTH] = '\0';
+			seq_escape(m, str, "\n\\");
+			break;
+		default:
+			// array tags' value is their length
+			if(tag->dtype & DT_ARRAY)
+				seq_printf(m, "%u", tag->value.u32);
+			break;
 	}
+}
+
+static int
+tagfd_tagsShow(struct seq_file * m, void * v)
+{
+	struct tag_ctx * ectx = v;
+	tagx_t tag;
 	
-	err = tagfd_construct_tag(&gl_tags[gl_nEntities], gl_nEntities+1, gl_tagfdClass ,ent, gl_newNameBuffer);
-	if(err)
+	if(v == SEQ_START_TOKEN)
 	{
-		printk(KERN_WARNING "tagfd.master: Failed to create tag at: %s\n",gl_newNameBuffer);
-		return err ;
+		seq_printf(m, "# id name dtype quality timestamp timestamp_ns generation value\n");
+		return 0;
 	}
-	gl_nEntities++;
 	
-	return sizeof(struct tag_config);
-}	
-
+	tagfd_readTag(ectx, &tag);
+	seq_printf(m, "%d %s %u %u %llu %llu %llu ", ectx->id, tagfd_tagName(ectx),
+	           tag.tag.dtype, tag.tag.quality, tag.tag.timestamp, tag.timestamp_ns, tag.generation);
+	tagfd_printValue(m, &tag.tag);
+	seq_putc(m, '\n');
+	return 0;
+}
 
-struct file_operations tagfd_masterFOps = {
-	.owner = THIS_MODULE,
-	.write = tagfd_masterWrite,
-	.open = tagfd_masterOpen,
-	.release = tagfd_masterRelease,
+static const struct seq_operations tagfd_tagsSeqOps = {
+	.start = tagfd_procStart,
+	.next  = tagfd_procNext,
+	.stop  = tagfd_procStop,
+	.show  = tagfd_tagsShow,
 };
 
 
@@ -519,28 +3571,69 @@ struct file_operations tagfd_masterFOps = {
 // Module initialization and exit
 // -----------------------------------------
 
+static struct tagfd_sysdev gl_sysdevs[NSYSDEVS] = {
+	[MINOR_MASTER] = { .name = MASTERNAME, .mode = 0200, .fops = &tagfd_masterFOps },
+	[MINOR_TABLE]  = { .name = TABLENAME,  .mode = 0444, .fops = &tagfd_tableFOps  },
+	[MINOR_SUB]    = { .name = SUBNAME,    .mode = 0666, .fops = &tagfd_subFOps    },
+	[MINOR_BULK]   = { .name = BULKNAME,   .mode = 0666, .fops = &tagfd_bulkFOps   },
+	[MINOR_BIND]   = { .name = BINDNAME,   .mode = 0666, .fops = &tagfd_bindFOps   },
+	[MINOR_JOURNAL]= { .name = JOURNALNAME,.mode = 0444, .fops = &tagfd_journalFOps},
+};
+
+// This function is used by our device class to set the permissions of the devices that it creates. 
+static char *
+tagfd_devnode(struct device *dev, umode_t *mode)
+{
+	if(!mode) return NULL;
+	if(MINOR(dev->devt) < NSYSDEVS)
+	{
+		*mode = gl_sysdevs[MINOR(dev->devt)].mode;
+	}
+	else
+	{
+		*mode = 0666;
+	}
+	
+	return NULL;
+}
+
 static void 
 tagfd_cleanup(void)
 {
 	int i;
 	
+	// Remove our /proc files first, they look at the tags.
+	proc_remove(gl_procDir);
+	
 	// Destruct our tags.
-	if(gl_tags)
+	for(i = 0; i < gl_nEntities; i++)
 	{
-		for(i = 0; i < gl_nEntities; i++)
-		{
-			// remember, minor number zero is the master device, so always pass i+1.
-			tagfd_destruct_tag(&gl_tags[i], i+1, gl_tagfdClass);
-		}
-		kfree(gl_tags);
+		tagfd_destruct_tag(tagfd_tagSlot(i), gl_tagfdClass);
+		kfree(tagfd_tagSlot(i));
+	}
+	for(i = 0; i < TAG_NCHUNKS; i++)
+	{
+		kfree(gl_tagChunks[i]);
+	}
+	
+	// Remove our system devices.
+	for(i = 0; i < NSYSDEVS; i++)
+	{
+		if(gl_sysdevs[i].status > 1)
+			device_destroy(gl_tagfdClass, MKDEV(MAJOR(gl_dev),i));
+		if(gl_sysdevs[i].status > 0)
+			cdev_del(&gl_sysdevs[i].cdev);
 	}
 	
-	// Remove our master device.
-	if(gl_masterStatus > 1)
-		device_destroy(gl_tagfdClass, MKDEV(MAJOR(gl_dev),0));
-	if(gl_masterStatus > 0)
-		cdev_del(&gl_masterCdev);
+	// Free the journal. 
+	vfree(gl_journal);
 	
+	// Free the shared table. 
+	for(i = 0; i < TABLE_NPAGES; i++)
+	{
+		if(gl_tablePages[i])
+			free_page((unsigned long)gl_tablePages[i]);
+	}
 	
 	// Destroy our device class.
 	if(gl_tagfdClass)
@@ -550,9 +3643,42 @@ tagfd_cleanup(void)
 	
 	// Unregister our character devices. 
 	// Note that this doesn't get called if alloc_chrdev_region fails. 
-	unregister_chrdev_region(gl_dev, max_tags+1);
+	unregister_chrdev_region(gl_dev, TAGFD_TAGS_LIMIT+NSYSDEVS);
+	
+	
+}
+
+// Adds one of the system devices (master, table, sub, bulk, tag, journal) to the system. 
+static int
+tagfd_createSysdev(int minor)
+{
+	int err;
+	struct device * device = NULL;
+	struct tagfd_sysdev * sdev = &gl_sysdevs[minor];
+	
+	cdev_init(&sdev->cdev, sdev->fops);
+	sdev->cdev.owner = THIS_MODULE;
+	err = cdev_add(&sdev->cdev, MKDEV(MAJOR(gl_dev),minor), 1);
+	if(err)
+	{
+		printk(KERN_WARNING "tagfd: failed to add %s device.\n", sdev->name);
+		return err;
+	}
+	sdev->status++;
 	
+	// Add the device to the filesystem
+	device = device_create(gl_tagfdClass, NULL, // no parent device
+	                       MKDEV(MAJOR(gl_dev),minor), NULL, // no additional data
+	                       sdev->name);
+	if(IS_ERR(device))
+	{
+		err = PTR_ERR(device);
+		printk(KERN_WARNING "tagfd: failed to add %s device to the filesystem: %d\n", sdev->name, err);
+		return err;
+	}
+	sdev->status++;
 	
+	return 0;
 }
 
 
@@ -560,20 +3686,27 @@ tagfd_cleanup(void)
 static int __init // "__init" (optional) tells the kernel that this function is only needed at init time. 
 tagfd_init(void)
 {	
-	int err;
-	struct device *masterDev = NULL;
+	int i, err;
 	
 	// Make sure max_tags is valid
-	if (max_tags < 1)
+	if (max_tags < 1 || max_tags > TAGFD_TAGS_LIMIT)
+	{
+		printk(KERN_WARNING "tagfd: %d is not a valid value for max_tags. Must be positive, and at most %d. \n", max_tags, TAGFD_TAGS_LIMIT);
+		return -EINVAL; // we can't goto fail yet, don't change this. 
+	}
+	if (journal_size < 1 || journal_size > (1 << 24))
 	{
-		printk(KERN_WARNING "tagfd: %d is not a valid value for max_tags. Must be positive. \n", max_tags);
+		printk(KERN_WARNING "tagfd: %d is not a valid value for journal_size. Must be positive, and at most %d. \n", journal_size, 1 << 24);
 		return -EINVAL; // we can't goto fail yet, don't change this. 
 	}
+	journal_size = roundup_pow_of_two(journal_size);
 	
 	// Allocate our range of char devices.
-	// Use module parameter "max_tags" to determine how many device minor numbers to register. 
+	// We reserve minor numbers for as many tags as we could ever have, so that max_tags can be
+	// raised later. Minor numbers don't cost anything until a device is actually added. 
 	// Device major number is acquired dynamically though alloc_chardev_region.
-	err = alloc_chrdev_region(&gl_dev, 0, max_tags+1, NAME);
+	BUILD_BUG_ON(TAGFD_TAGS_LIMIT + NSYSDEVS > (1 << MINORBITS));
+	err = alloc_chrdev_region(&gl_dev, 0, TAGFD_TAGS_LIMIT+NSYSDEVS, NAME);
 	if(err < 0)
 	{
 		printk(KERN_WARNING "tagfd: failed to allocate chardev region, errror %d.\n", err);
@@ -592,38 +3725,33 @@ tagfd_init(void)
 	}
 	gl_tagfdClass->devnode = tagfd_devnode;
 	
-	// Allocate memory for our actual data storage. 
-	gl_tags = kmalloc(max_tags * sizeof(struct tag_ctx),GFP_KERNEL);
-	if(gl_tags == NULL)
+	// Allocate the journal
+	gl_journal = vmalloc(array_size(journal_size, sizeof(struct tag_journal_entry)));
+	if(gl_journal == NULL)
 	{
-		printk(KERN_WARNING "tagfd: failed to allocate tags.\n");
+		printk(KERN_WARNING "tagfd: failed to allocate the journal\n");
 		err = -ENOMEM;
 		goto fail;
 	}
-	memset(gl_tags,0,sizeof(struct tag_ctx) * max_tags);
 	
-	// Create our master device
-	cdev_init(&gl_masterCdev, &tagfd_masterFOps);
-	gl_masterCdev.owner = THIS_MODULE;
-	err = cdev_add(&gl_masterCdev, MKDEV(MAJOR(gl_dev),0), 1);
-	if(err)
+	// Create /proc/tagfd/
+	gl_procDir = proc_mkdir(NAME, NULL);
+	if(gl_procDir == NULL ||
+	   proc_create_seq("stats", 0444, gl_procDir, &tagfd_statsSeqOps) == NULL ||
+	   proc_create_seq("tags",  0444, gl_procDir, &tagfd_tagsSeqOps)  == NULL)
 	{
-		printk(KERN_WARNING "tagfd: failed to add master device.\n");
+		printk(KERN_WARNING "tagfd: failed to create /proc/%s\n", NAME);
+		err = -ENOMEM;
 		goto fail;
 	}
-	gl_masterStatus++;
 	
-	// Add the master device to the filesystem
-	masterDev = device_create(gl_tagfdClass, NULL, // no parent device
-	                          MKDEV(MAJOR(gl_dev),0), NULL, // no additional data
-							  "tagfd.master");
-	if(IS_ERR(masterDev))
+	// Create our system devices (master, table, sub, bulk, tag, journal)
+	for(i = 0; i < NSYSDEVS; i++)
 	{
-		err = PTR_ERR(masterDev);
-		printk(KERN_WARNING "tagfd: failed to add master device to the filesystem: %d\n", err);
-		goto fail;
+		err = tagfd_createSysdev(i);
+		if(err)
+			goto fail;
 	}
-	gl_masterStatus++;
 	
 	printk(KERN_WARNING "tagfd: loaded.\n");
 	return 0;
@@ -125,23 +125,20 @@ void throwawayReadTimerFD(int fd)
         
 }
 
-void incrementTimerTag(tag_t * tag)
+// Increments a timer tag in the kernel (one atomic fetch-add, so it can't 
+// race with anybody else writing the tag), and updates our copy of it. 
+// The timer tags' file descriptors have TAGFD_FLAG_KERNELTIME set, so the 
+// module timestamps the write (and a clock step can't get it rejected). 
+bool incrementTimerTag(int fd, tag_t * tag)
 {
-    switch(tag->dtype)
-    {
-        case DT_UINT8:
-            tag->value.u8++;
-            break;
-        case DT_UINT16:
-            tag->value.u16++;
-            break;
-        case DT_UINT32:
-            tag->value.u32++;
-            break;
-        case DT_UINT64:
-            tag->value.u64++;
-            break;
-    }
+    struct tag_fetchadd add = { .delta = 1 };
+    
+    add.tag.tag = *tag;
+    if(!fetchAddTag(fd, &add))
+        return false;
+    
+    *tag = add.tag.tag;
+    return true;
 }
 
 
@@ -364,19 +361,30 @@ struct findTagsCtx
     struct int_vec * timerSecondsV;
 };
 
-// directory walking callback for finding tagfd tags
-int findTags(void* param, const char * name, const char * path, struct stat sb)
+// tag listing callback for finding the tags we care about
+int findTags(void* param, int id, const char * name, const tagx_t * tag)
 {
     struct findTagsCtx * ctx = param;
     
-    if(!S_ISCHR(sb.st_mode)) return 0;
-    
     if( 0 == strcmp(name, MASTERKILLSWITCH_TAGNAME))
         *ctx->foundMasterKillswitch = true;
     
     else 
     if(0==regexec(ctx->rgx, name, 0, NULL,0))
     {
+        // timer tags created with a period are counted by the kernel module
+        // itself, so leave those alone.
+        uint64_t period_ns = 0;
+        int fd = openTag(name, O_RDONLY);
+        if(fd >= 0)
+        {
+            if(!getTagPeriod(fd, &period_ns))
+                period_ns = 0;
+            close(fd);
+        }
+        if(period_ns > 0)
+            return 0;
+        
         if(!str_vec_append(ctx->timerNameV, strdup(name)))
             PrintAbort("Vector append: %s ", strerror(errno) );
         
@@ -472,9 +480,9 @@ int main(int argc, char ** argv)
         .timerSecondsV = &timerSecondsVec
     };
     
-    if(walkDirectory("/dev/tagfd", NULL, &ftc, &err, findTags, cantStat))
+    if(listTags(NULL, &ftc, findTags))
     {
-        PrintAbort("%s failure when walking directory /dev/tagfd. errno: %s", err, strerror(errno));
+        PrintAbort("Failed to list tags from /proc/tagfd/tags: %s", strerror(errno));
     }
     
     if(!foundMasterKillswitch)
@@ -517,6 +525,8 @@ int main(int argc, char ** argv)
         pfd.revents = 0;
         
         int tagfd = assertOpenTag(timerStrArr[i]);
+        if(!setTagFlags(tagfd, TAGFD_FLAG_KERNELTIME))
+            LogAbort(LOG_ERR, "Couldn't set flags on %s: %s", timerStrArr[i], strerror(errno));
         tag_t tagval = assertReadTag(tagfd);
         switch(tagval.dtype)
         {
@@ -638,9 +648,7 @@ int main(int argc, char ** argv)
                 
                 tag_t * tagPtr = &tag_vec_ptr(&tags)[i];
                 
-                incrementTimerTag(tagPtr);
-                setTagTimestamp(tagPtr);
-                if(!tryWriteTag(int_vec_ptr(&tagfds)[i], *tagPtr))
+                if(!incrementTimerTag(int_vec_ptr(&tagfds)[i], tagPtr))
                     Log(LOG_ERR, "Failed to write tag %s: %s", str_vec_ptr(&timerNameVec)[i], strerror(errno));
             }
             
@@ -665,7 +673,6 @@ int main(int argc, char ** argv)
     for(int i = 0; i < NTIMERS; i++)
     {
         tag_t * tagp = &tag_vec_ptr(&tags)[i];
-        setTagTimestamp(tagp);
         tagp->quality = QUALITY_DISCONNECTED;
         tryWriteTag(int_vec_ptr(&tagfds)[i], *tagp);
     }
@@ -27,6 +27,11 @@
 #include <time.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 
 
 #include <float.h>
@@ -142,6 +147,19 @@ static _Thread_local const char * STRING = "string";
 
 const char * tag_dtype_toStrHR(const tag_t *e )
 {
+	static _Thread_local char arrstr[32];
+	
+	// array tags' value is their length, e.g. real32[4096]
+	if(e->dtype & DT_ARRAY)
+	{
+		tag_t elem = { .dtype = DT_ELEMENT(e->dtype) };
+		const char * s = tag_dtype_toStrHR(&elem);
+		if(s == NULL)
+			return NULL;
+		snprintf(arrstr, sizeof(arrstr), "%s[%"PRIu32"]", s, e->value.u32);
+		return arrstr;
+	}
+	
 	switch(e->dtype)
 	{
 		case DT_INT8:
@@ -243,6 +261,10 @@ const char * tag_value_toStrHR(const tag_t *e )
 		case DT_STRING:
 			memcpy(evstr, e->value.string, TAG_STRING_VALUE_LENGTH);
 			break;
+		default:
+			if(e->dtype & DT_ARRAY)
+				sprintf(evstr,"(%"PRIu32" elements)", e->value.u32);
+			break;
 	}
 	return evstr;
 }
@@ -313,6 +335,7 @@ const char * tag_value_toStr(const tag_t *e )
     else if(e->dtype == DT_REAL64) sprintf(evstr,"%."WR64"le", e->value.real64);
     else if(e->dtype == DT_TIMESTAMP) sprintf(evstr,"%"PRIu64, e->value.timestamp);
     else if(e->dtype == DT_STRING)  memcpy(evstr,e->value.string,TAG_STRING_VALUE_LENGTH);
+    else if(e->dtype & DT_ARRAY) sprintf(evstr,"%"PRIu32, e->value.u32); // (the length)
 
     return evstr;
 }
@@ -414,3 +437,765 @@ uint8_t tag_dtype_fromStrHR(const char * str)
     else if(!strcmp(str, "string")) return DT_STRING ;
     else return DT_INVALID;
 }
+
+
+
+
+// ====================================================================================
+//  Shared tag table
+// ====================================================================================
+
+struct tag_table
+{
+    const struct tag_shm_entry * entries;   // mapped for TAGFD_TAGS_LIMIT entries
+    uint32_t                     capacity;  // last known max_tags, entries beyond this can't be touched
+    size_t                       mapLength;
+    int                          fd;        // kept open to refresh the capacity
+};
+
+int getTagId(int fd)
+{
+    uint32_t id;
+    if(ioctl(fd, TAGFD_IOC_GETID, &id) < 0)
+        return -1;
+    return id;
+}
+
+tag_table_t * tagTableOpen(void)
+{
+    int fd = open("/dev/tagfd.table", O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return NULL;
+    
+    uint32_t capacity;
+    if(ioctl(fd, TAGFD_IOC_CAPACITY, &capacity) < 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    
+    tag_table_t * table = malloc(sizeof(tag_table_t));
+    if(!table)
+    {
+        close(fd);
+        return NULL;
+    }
+    
+    // Map the whole possible table, so we don't need to remap if max_tags is raised. 
+    // Pages are only populated as we touch them.
+    table->fd = fd;
+    table->capacity = capacity;
+    table->mapLength = (size_t)TAGFD_TAGS_LIMIT * sizeof(struct tag_shm_entry);
+    table->entries = mmap(NULL, table->mapLength, PROT_READ, MAP_SHARED, fd, 0);
+    
+    if(table->entries == MAP_FAILED)
+    {
+        close(fd);
+        free(table);
+        return NULL;
+    }
+    
+    return table;
+}
+
+void tagTableClose(tag_table_t * table)
+{
+    if(!table) return;
+    munmap((void*)table->entries, table->mapLength);
+    close(table->fd);
+    free(table);
+}
+
+bool tagTableRead(tag_table_t * table, int id, tag_t * output)
+{
+    tagx_t x;
+    if(!tagTableReadExtended(table, id, &x))
+        return false;
+    *output = x.tag;
+    return true;
+}
+
+bool tagTableReadExtended(tag_table_t * table, int id, tagx_t * output)
+{
+    if(id < 0 || id >= TAGFD_TAGS_LIMIT)
+        return false;
+    
+    // Touching an entry beyond max_tags would fault, so check whether it's been raised.
+    if(id >= __atomic_load_n(&table->capacity, __ATOMIC_RELAXED))
+    {
+        uint32_t capacity;
+        if(ioctl(table->fd, TAGFD_IOC_CAPACITY, &capacity) < 0 || id >= capacity)
+            return false;
+        __atomic_store_n(&table->capacity, capacity, __ATOMIC_RELAXED);
+    }
+    
+    const struct tag_shm_entry * e = &table->entries[id];
+    uint32_t seq;
+    
+    // Retry until we see the same even sequence number on both sides of the copy.
+    do
+    {
+        seq = __atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE);
+        if(seq & 1) continue;
+        memcpy(&output->tag, (const void*)&e->tag, sizeof(tag_t));
+        output->generation = e->generation;
+        output->timestamp_ns = e->timestamp_ns;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } 
+    while((seq & 1) || seq != __atomic_load_n(&e->sequence, __ATOMIC_RELAXED));
+    
+    return output->tag.dtype != DT_INVALID;
+}
+
+bool setTagFlags(int fd, uint32_t flags)
+{
+    return ioctl(fd, TAGFD_IOC_SETFLAGS, &flags) == 0;
+}
+
+bool setTagFilter(int fd, const struct tag_filter * filter)
+{
+    return ioctl(fd, TAGFD_IOC_SETFILTER, filter) == 0;
+}
+
+bool setTagQueue(int fd, uint32_t depth)
+{
+    return ioctl(fd, TAGFD_IOC_SETQUEUE, &depth) == 0;
+}
+
+bool getTagOverflow(int fd, uint64_t * overflow)
+{
+    return ioctl(fd, TAGFD_IOC_GETOVERFLOW, overflow) == 0;
+}
+
+bool setTagAggregate(int fd, bool on)
+{
+    uint32_t arg = on;
+    return ioctl(fd, TAGFD_IOC_SETAGGREGATE, &arg) == 0;
+}
+
+bool waitReadTag(int fd, uint64_t timeout_ns, tagx_t * tag)
+{
+    struct tag_waitread req = { .timeout_ns = timeout_ns };
+    
+    if(ioctl(fd, TAGFD_IOC_WAITREAD, &req) < 0)
+        return false;
+    *tag = req.tag;
+    return true;
+}
+
+bool getTagPeriod(int fd, uint64_t * period_ns)
+{
+    return ioctl(fd, TAGFD_IOC_GETPERIOD, period_ns) == 0;
+}
+
+bool casTag(int fd, struct tag_cas * cas)
+{
+    return ioctl(fd, TAGFD_IOC_CAS, cas) == 0;
+}
+
+bool fetchAddTag(int fd, struct tag_fetchadd * add)
+{
+    return ioctl(fd, TAGFD_IOC_FETCHADD, add) == 0;
+}
+
+int openSubscription(void)
+{
+    return open("/dev/tagfd.sub", O_RDONLY | O_CLOEXEC);
+}
+
+bool subscribeTag(int fd, int id)
+{
+    uint32_t uid = id;
+    return ioctl(fd, TAGFD_IOC_SUBSCRIBE, &uid) == 0;
+}
+
+bool unsubscribeTag(int fd, int id)
+{
+    uint32_t uid = id;
+    return ioctl(fd, TAGFD_IOC_UNSUBSCRIBE, &uid) == 0;
+}
+
+int openJournal(void)
+{
+    return open("/dev/tagfd.journal", O_RDONLY | O_CLOEXEC);
+}
+
+int openBulk(void)
+{
+    return open("/dev/tagfd.bulk", O_RDONLY | O_CLOEXEC);
+}
+
+static bool bulkIoctl(int fd, unsigned long cmd, struct tag_bulk_entry * entries, size_t count, uint32_t flags)
+{
+    // The kernel stops early if it's interrupted, so carry on from wherever it got to.
+    size_t done = 0;
+    while(done < count)
+    {
+        size_t n = count - done;
+        if(n > INT_MAX) n = INT_MAX;
+        
+        struct tag_bulk req = {
+            .entries = (uintptr_t)(entries + done),
+            .count = n,
+            .flags = flags
+        };
+        
+        int rc = ioctl(fd, cmd, &req);
+        if(rc < 0)
+        {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        done += rc;
+    }
+    return true;
+}
+
+bool bulkReadTags(int fd, struct tag_bulk_entry * entries, size_t count)
+{
+    return bulkIoctl(fd, TAGFD_IOC_BULKREAD, entries, count, 0);
+}
+
+bool bulkWriteTags(int fd, struct tag_bulk_entry * entries, size_t count, uint32_t flags)
+{
+    return bulkIoctl(fd, TAGFD_IOC_BULKWRITE, entries, count, flags);
+}
+
+bool txWriteTags(int fd, struct tag_bulk_entry * entries, size_t count, uint32_t flags)
+{
+    struct tag_bulk req = { .entries = (uintptr_t)entries, .count = count, .flags = flags };
+    
+    if(count > TAGFD_TX_MAX)
+    {
+        errno = E2BIG;
+        return false;
+    }
+    
+    // Nothing has been written if the call was interrupted.
+    int rc;
+    do rc = ioctl(fd, TAGFD_IOC_TXWRITE, &req);
+    while(rc < 0 && errno == EINTR);
+    return rc == 0;
+}
+
+bool snapshotTags(int fd, struct tag_bulk_entry * entries, size_t count)
+{
+    struct tag_bulk req = { .entries = (uintptr_t)entries, .count = count };
+    
+    if(count > TAGFD_TAGS_LIMIT)
+    {
+        errno = E2BIG;
+        return false;
+    }
+    
+    int rc;
+    do rc = ioctl(fd, TAGFD_IOC_SNAPSHOT, &req);
+    while(rc < 0 && errno == EINTR);
+    return rc == 0;
+}
+
+int lookupTagId(int fd, const char * name)
+{
+    struct tag_lookup req;
+    memset(&req, 0, sizeof(req));
+    
+    if(strlen(name) >= TAG_NAME_LENGTH)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    strcpy(req.name, name);
+    
+    if(ioctl(fd, TAGFD_IOC_LOOKUP, &req) < 0)
+        return -1;
+    return req.id;
+}
+
+int openTag(const char * name, int flags)
+{
+    char path[TAG_NAME_LENGTH + 100];
+    if(strlen(name) >= TAG_NAME_LENGTH)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/dev/tagfd/%s", name);
+    
+    int fd = open(path, flags);
+    if(fd >= 0 || errno != ENOENT)
+        return fd;
+    
+    // no device file, so bind to it by name instead.
+    fd = open("/dev/tagfd.tag", flags);
+    if(fd < 0)
+        return -1;
+    
+    struct tag_lookup req;
+    memset(&req, 0, sizeof(req));
+    strcpy(req.name, name);
+    if(ioctl(fd, TAGFD_IOC_BINDNAME, &req) < 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// Parses the value at the end of a line of /proc/tagfd/tags (see tagfd_printValue 
+// in the kernel module). Returns false if it's malformed. 
+static bool parseListedValue(const char * s, tag_t * tag)
+{
+    char * end = NULL;
+    
+    errno = 0;
+    switch(tag->dtype)
+    {
+        case DT_INT8:      tag->value.i8  = strtol(s, &end, 10);   break;
+        case DT_UINT8:     tag->value.u8  = strtoul(s, &end, 10);  break;
+        case DT_INT16:     tag->value.i16 = strtol(s, &end, 10);   break;
+        case DT_UINT16:    tag->value.u16 = strtoul(s, &end, 10);  break;
+        case DT_INT32:     tag->value.i32 = strtol(s, &end, 10);   break;
+        case DT_UINT32:    tag->value.u32 = strtoul(s, &end, 10);  break;
+        case DT_INT64:     tag->value.i64 = strtoll(s, &end, 10);  break;
+        case DT_UINT64:    tag->value.u64 = strtoull(s, &end, 10); break;
+        case DT_TIMESTAMP: tag->value.timestamp = strtoull(s, &end, 10); break;
+        
+        // reals are listed as the hex of their bits
+        case DT_REAL32:    tag->value.u32 = strtoul(s, &end, 16);  break;
+        case DT_REAL64:    tag->value.u64 = strtoull(s, &end, 16); break;
+        
+        // strings run to the end of the line, with newlines and backslashes as \ooo
+        case DT_STRING:
+            for(int i = 0; *s; i++)
+            {
+                if(i == TAG_STRING_VALUE_LENGTH)
+                    return false;
+                if(s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7')
+                {
+                    tag->value.string[i] = (s[1] - '0') * 64 + (s[2] - '0') * 8 + (s[3] - '0');
+                    s += 4;
+                }
+                else
+                {
+                    tag->value.string[i] = *s++;
+                }
+            }
+            return true;
+        
+        default:
+            // array tags are listed with their length
+            if(tag->dtype & DT_ARRAY)
+            {
+                tag->value.u32 = strtoul(s, &end, 10);
+                break;
+            }
+            return true;
+    }
+    
+    return end != s && *end == '\0' && errno == 0;
+}
+
+int listTags(const char * filter, void * callbackParam,
+             int (*callback) (void * param, int id, const char * name, const tagx_t * tag))
+{
+    FILE * f = fopen("/proc/tagfd/tags", "re");
+    if(!f)
+        return -1;
+    
+    size_t filtlen = filter ? strlen(filter) : 0;
+    char line[TAG_NAME_LENGTH + 4 * TAG_STRING_VALUE_LENGTH + 200];
+    char name[TAG_NAME_LENGTH];
+    
+    while(fgets(line, sizeof(line), f))
+    {
+        if(line[0] == '#')
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        
+        int id, n = 0;
+        unsigned dtype, quality;
+        unsigned long long timestamp, timestamp_ns, generation;
+        tagx_t tag;
+        memset(&tag, 0, sizeof(tag));
+        
+        if(sscanf(line, "%d %255s %u %u %llu %llu %llu%n", &id, name, &dtype, &quality, 
+                  &timestamp, &timestamp_ns, &generation, &n) != 7 || line[n] != ' ')
+        {
+            fclose(f);
+            errno = EPROTO;
+            return -1;
+        }
+        
+        tag.tag.dtype = dtype;
+        tag.tag.quality = quality;
+        tag.tag.timestamp = timestamp;
+        tag.timestamp_ns = timestamp_ns;
+        tag.generation = generation;
+        if(!parseListedValue(line + n + 1, &tag.tag))
+        {
+            fclose(f);
+            errno = EPROTO;
+            return -1;
+        }
+        
+        if(filter && strncmp(filter, name, filtlen))
+            continue;
+        
+        if(callback(callbackParam, id, name, &tag))
+        {
+            fclose(f);
+            return 1;
+        }
+    }
+    
+    int err = ferror(f) ? errno : 0;
+    fclose(f);
+    if(err)
+    {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+
+
+// ============================================================================
+//  Tag rings (io_uring)
+// ============================================================================
+
+// There's no liburing dependency, so this talks to io_uring directly. Only the 
+// parts needed for one read in flight per tag are here.
+
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct tag_ring
+{
+    int                   ringfd;
+    size_t                count;
+    const int           * fds;
+    tagx_t              * bufs;        // one per tag, read into by the kernel
+    struct iovec        * iovs;
+    
+    // submission queue
+    void                * sqMap;
+    size_t                sqMapSize;
+    unsigned            * sqHead;
+    unsigned            * sqTail;
+    unsigned            * sqMask;
+    unsigned            * sqArray;
+    struct io_uring_sqe * sqes;
+    size_t                sqesSize;
+    unsigned              sqEntries;
+    unsigned              toSubmit;    // queued in the ring, but not passed to the kernel yet
+    
+    // completion queue
+    void                * cqMap;
+    size_t                cqMapSize;
+    unsigned            * cqHead;
+    unsigned            * cqTail;
+    unsigned            * cqMask;
+    struct io_uring_cqe * cqes;
+};
+
+static int ringEnter(struct tag_ring * ring, unsigned submit, unsigned wait)
+{
+    int rc;
+    do rc = syscall(__NR_io_uring_enter, ring->ringfd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while(rc < 0 && errno == EINTR && !wait);
+    return rc;
+}
+
+// Hands the queued reads to the kernel. 
+static bool ringSubmit(struct tag_ring * ring, unsigned wait)
+{
+    while(ring->toSubmit || wait)
+    {
+        int rc = ringEnter(ring, ring->toSubmit, wait);
+        if(rc < 0)
+            return false;
+        ring->toSubmit -= rc;
+        wait = 0;
+    }
+    return true;
+}
+
+// Queues a read of tag i. 
+static bool ringQueueRead(struct tag_ring * ring, size_t i)
+{
+    unsigned tail = *ring->sqTail;
+    
+    // full: make room by submitting what's there.
+    if(tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries && !ringSubmit(ring, 0))
+        return false;
+    
+    unsigned idx = tail & *ring->sqMask;
+    struct io_uring_sqe * sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = ring->fds[i];
+    sqe->addr = (uintptr_t)&ring->iovs[i];
+    sqe->len = 1;
+    sqe->user_data = i;
+    ring->sqArray[idx] = idx;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+    return true;
+}
+
+static bool ringMap(struct tag_ring * ring, const struct io_uring_params * p)
+{
+    ring->sqMapSize = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQ_RING);
+    if(ring->sqMap == MAP_FAILED)
+        return false;
+    ring->sqHead    = (unsigned *)((char *)ring->sqMap + p->sq_off.head);
+    ring->sqTail    = (unsigned *)((char *)ring->sqMap + p->sq_off.tail);
+    ring->sqMask    = (unsigned *)((char *)ring->sqMap + p->sq_off.ring_mask);
+    ring->sqArray   = (unsigned *)((char *)ring->sqMap + p->sq_off.array);
+    ring->sqEntries = p->sq_entries;
+    
+    ring->sqesSize = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+        return false;
+    
+    ring->cqMapSize = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_CQ_RING);
+    if(ring->cqMap == MAP_FAILED)
+        return false;
+    ring->cqHead = (unsigned *)((char *)ring->cqMap + p->cq_off.head);
+    ring->cqTail = (unsigned *)((char *)ring->cqMap + p->cq_off.tail);
+    ring->cqMask = (unsigned *)((char *)ring->cqMap + p->cq_off.ring_mask);
+    ring->cqes   = (struct io_uring_cqe *)((char *)ring->cqMap + p->cq_off.cqes);
+    return true;
+}
+
+struct tag_ring * openTagRing(const int * fds, size_t count)
+{
+    if(count == 0 || count > TAGFD_TAGS_LIMIT)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    struct tag_ring * ring = calloc(1, sizeof(struct tag_ring));
+    if(ring == NULL)
+        return NULL;
+    ring->ringfd = -1;
+    ring->sqMap = ring->cqMap = ring->sqes = MAP_FAILED;
+    ring->count = count;
+    ring->fds = fds;
+    ring->bufs = calloc(count, sizeof(tagx_t));
+    ring->iovs = calloc(count, sizeof(struct iovec));
+    if(ring->bufs == NULL || ring->iovs == NULL)
+        goto fail;
+    for(size_t i = 0; i < count; i++)
+    {
+        ring->iovs[i].iov_base = &ring->bufs[i];
+        ring->iovs[i].iov_len = sizeof(tagx_t);
+    }
+    
+    // Every tag has a read in flight, so the completion queue has to be able to 
+    // hold all of them. The submission queue can be smaller, it's flushed when full.
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    unsigned entries = count < TAG_RING_MAX_SUBMIT ? count : TAG_RING_MAX_SUBMIT;
+    if(count > 2 * (size_t)entries)
+    {
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = count;
+    }
+    ring->ringfd = syscall(__NR_io_uring_setup, entries, &p);
+    if(ring->ringfd < 0 || !ringMap(ring, &p))
+        goto fail;
+    
+    for(size_t i = 0; i < count; i++)
+        if(!ringQueueRead(ring, i))
+            goto fail;
+    if(!ringSubmit(ring, 0))
+        goto fail;
+    
+    return ring;
+    
+fail:
+    {
+        int err = errno;
+        closeTagRing(ring);
+        errno = err;
+        return NULL;
+    }
+}
+
+int waitTagRing(struct tag_ring * ring, struct tag_ring_event * events, int max)
+{
+    int n = 0;
+    
+    // submit the reads queued again by the previous call, and wait for at least one
+    unsigned head = *ring->cqHead;
+    if(!ringSubmit(ring, head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)))
+        return -1;
+    
+    while(n < max && head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe * cqe = &ring->cqes[head & *ring->cqMask];
+        size_t i = cqe->user_data;
+        
+        events[n].index = i;
+        events[n].result = cqe->res;
+        if(cqe->res > 0)
+            memcpy(&events[n].tag, &ring->bufs[i], cqe->res);
+        n++;
+        head++;
+        
+        // keep watching the tag, unless it's gone (or the descriptor is unusable)
+        if((cqe->res >= 0 || cqe->res == -EINTR) && !ringQueueRead(ring, i))
+        {
+            __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+            return -1;
+        }
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    
+    return n;
+}
+
+void closeTagRing(struct tag_ring * ring)
+{
+    if(ring == NULL)
+        return;
+    
+    // closing the ring cancels the reads in flight
+    if(ring->sqMap != MAP_FAILED) munmap(ring->sqMap, ring->sqMapSize);
+    if(ring->sqes != MAP_FAILED)  munmap(ring->sqes, ring->sqesSize);
+    if(ring->cqMap != MAP_FAILED) munmap(ring->cqMap, ring->cqMapSize);
+    if(ring->ringfd >= 0)
+        close(ring->ringfd);
+    free(ring->bufs);
+    free(ring->iovs);
+    free(ring);
+}
+
+
+
+// ============================================================================
+//  Array tags
+// ============================================================================
+
+struct tag_array_map
+{
+    const struct tag_array_shm * shm;
+    size_t                       mapLength;
+    size_t                       size;      // of the elements
+};
+
+bool getTagArraySize(int fd, uint32_t * size)
+{
+    return ioctl(fd, TAGFD_IOC_ARRAYSIZE, size) == 0;
+}
+
+size_t tagArrayElementSize(uint8_t dtype)
+{
+    switch(dtype)
+    {
+        case DT_INT8:
+        case DT_UINT8:     return 1;
+        case DT_INT16:
+        case DT_UINT16:    return 2;
+        case DT_INT32:
+        case DT_UINT32:
+        case DT_REAL32:    return 4;
+        case DT_INT64:
+        case DT_UINT64:
+        case DT_REAL64:
+        case DT_TIMESTAMP: return 8;
+        default:           return 0;
+    }
+}
+
+// The size of the tag that read() and write() exchange on a descriptor with these flags.
+static size_t recordSize(uint32_t flags)
+{
+    return (flags & TAGFD_FLAG_EXTENDED) ? sizeof(tagx_t) : sizeof(tag_t);
+}
+
+bool readTagArray(int fd, tagx_t * tag, void * data, size_t size, uint32_t flags)
+{
+    size_t len = recordSize(flags);
+    struct iovec iov[2] = { { tag, len }, { data, size } };
+    
+    ssize_t n = readv(fd, iov, 2);
+    if(n >= 0 && (size_t)n != len + size)
+        errno = EINVAL; // (data was bigger than the array)
+    return n >= 0 && (size_t)n == len + size;
+}
+
+bool writeTagArray(int fd, const tagx_t * tag, const void * data, size_t size, uint32_t flags)
+{
+    size_t len = recordSize(flags);
+    struct iovec iov[2] = { { (void *)tag, len }, { (void *)data, size } };
+    
+    ssize_t n = writev(fd, iov, 2);
+    if(n >= 0 && (size_t)n != len + size)
+        errno = EINVAL;
+    return n >= 0 && (size_t)n == len + size;
+}
+
+tag_array_map_t * tagArrayMap(int fd)
+{
+    uint32_t size;
+    if(!getTagArraySize(fd, &size))
+        return NULL;
+    if(size == 0)
+    {
+        errno = ENODEV;
+        return NULL;
+    }
+    
+    tag_array_map_t * map = malloc(sizeof(tag_array_map_t));
+    if(!map)
+        return NULL;
+    
+    map->size = size;
+    map->mapLength = sizeof(struct tag_array_shm) + 2 * (size_t)size;
+    map->shm = mmap(NULL, map->mapLength, PROT_READ, MAP_SHARED, fd, 0);
+    if(map->shm == MAP_FAILED)
+    {
+        free(map);
+        return NULL;
+    }
+    
+    return map;
+}
+
+bool tagArrayRead(tag_array_map_t * map, tagx_t * tag, void * data)
+{
+    const struct tag_array_shm * a = map->shm;
+    uint32_t seq;
+    
+    // The same protocol as the shared table, with the current copy of the elements inside it.
+    do
+    {
+        seq = __atomic_load_n(&a->entry.sequence, __ATOMIC_ACQUIRE);
+        if(seq & 1) continue;
+        memcpy(&tag->tag, (const void*)&a->entry.tag, sizeof(tag_t));
+        tag->generation = a->entry.generation;
+        tag->timestamp_ns = a->entry.timestamp_ns;
+        memcpy(data, TAG_ARRAY_ELEMENTS(a, __atomic_load_n(&a->active, __ATOMIC_RELAXED) & 1), map->size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } 
+    while((seq & 1) || seq != __atomic_load_n(&a->entry.sequence, __ATOMIC_RELAXED));
+    
+    return tag->tag.dtype != DT_INVALID;
+}
+
+void tagArrayUnmap(tag_array_map_t * map)
+{
+    if(!map) return;
+    munmap((void*)map->shm, map->mapLength);
+    free(map);
+}
@@ -91,56 +91,37 @@ int countDigits (int n) {
 #define TEMPLATE_DEF
 #include "templates/smallvector.h"
 
-void list(const char * filter )
+// listTags callback: collects the tags into a vector. 
+int listOne(void * param, int id, const char * name, const tagx_t * tag)
 {
-	struct tag_vec tags;
-	tag_vec_init(&tags);
+	struct tag_vec * tags = param;
 	
-	// Open /dev/tagfd/ directory
-	DIR * devdir = opendir("/dev/tagfd"); 
-	if(!devdir)
+	named_tag_t e ;
+	memset(&e,0,sizeof(e));
+	strcpy(e.name, name);
+	e.tag = tag->tag;
+	
+	if(!tag_vec_append(tags, e))
 	{
-		perror("Can't open /dev/tagfd");
+		perror("Vector append failed");
 		exit(EXIT_FAILURE);
 	}
+	return 0;
+}
+
+void list(const char * filter )
+{
+	struct tag_vec tags;
+	tag_vec_init(&tags);
 	
-	// Walk the /dev/tagfd directory
-	while(1)
+	// Get every tag (and its value) in one go
+	if(listTags(filter, &tags, listOne) < 0)
 	{
-		struct dirent * entry = readdir(devdir);
-		if(!entry) break;
-		
-		char pathbuf [PATH_MAX+100];
-		sprintf(pathbuf, "/dev/tagfd/%s", entry->d_name);
-		struct stat statbuf;
-		if (lstat(pathbuf, &statbuf) < 0)
-		{
-			printf("Couldn't stat %s, check permissions.\n", pathbuf);
-		}
-		else
-		{
-			if(S_ISCHR(statbuf.st_mode))
-			{
-				if(filter && 0 != strncmp(filter, entry->d_name, strlen(filter))) 
-					continue;
-				
-				named_tag_t e ;
-				memset(&e,0,sizeof(e));
-				strcpy(e.name, entry->d_name);
-				
-                int fd = assertOpenTag(e.name);
-				e.tag = assertReadTag(fd);
-                close(fd);
-				
-				tag_vec_append(&tags, e);
-			}
-		}
+		perror("Can't list tags from /proc/tagfd/tags");
+		exit(EXIT_FAILURE);
 	}
 	
 	
-	closedir(devdir);
-	
-	
 	// sort the tag list by name, if necessary.
 	if(tag_vec_size(&tags) > 1)
 		qsort( tag_vec_ptr(&tags),
@@ -370,6 +351,76 @@ void setquality(const char * tag, const char * quality, const char * vendor)
 }
 
 
+// ====================================================================================
+//  COMMAND HANDLER: READ
+// ====================================================================================
+
+// Prints an array tag's elements (size bytes of them), one per line. 
+void printArray(const tag_t * ent, const void * data, uint32_t size)
+{
+	size_t elementSize = tagArrayElementSize(ent->dtype);
+	if(elementSize == 0)
+		return;
+	
+	tag_t element = *ent;
+	for(uint32_t i = 0; i < size / elementSize; i++)
+	{
+		memset(&element.value, 0, sizeof(tagvalue_t));
+		memcpy(&element.value, (const char *)data + i * elementSize, elementSize);
+		printf("  [%"PRIu32"] %s\n", i, tag_value_toStrHR(&element));
+	}
+}
+
+void readtag(const char * tag)
+{
+	int fd = assertOpenTag(tag);
+	tagx_t entx;
+	uint32_t size = 0;
+	void * data = NULL;
+	bool ok = setTagFlags(fd, TAGFD_FLAG_EXTENDED) && getTagArraySize(fd, &size);
+	if(ok && size)
+	{
+		data = malloc(size);
+		ok = data && readTagArray(fd, &entx, data, size, TAGFD_FLAG_EXTENDED);
+	}
+	else if(ok)
+	{
+		ok = read(fd, &entx, sizeof(tagx_t)) == sizeof(tagx_t);
+	}
+	if(!ok)
+	{
+		printf("Couldn't read %s: %s\n", tag, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	
+	tag_t ent = entx.tag;
+	printf("name       %s\n"
+	       "dtype      %s\n"
+	       "quality    %s\n"
+	       "timestamp  %s (%"PRIu64" ns)\n"
+	       "generation %"PRIu64"\n",
+		tag, 
+		tag_dtype_toStrHR(&ent), 
+		tag_quality_toStrHR(&ent, false), 
+		tag_timestamp_toStrHR(&ent),
+		entx.timestamp_ns,
+		entx.generation);
+	
+	// an array tag's value is its length
+	if(data)
+	{
+		printf("length     %"PRIu32"\n", ent.value.u32);
+		printArray(&ent, data, size);
+		free(data);
+	}
+	else
+	{
+		printf("value      %s\n", tag_value_toStrHR(&ent));
+	}
+}
+
+
 // ====================================================================================
 //  MAIN
 // ====================================================================================
@@ -393,19 +444,7 @@ int main(int argc, char ** argv)
 	else if(0 == strcmp(argv[1], "r"))
 	{
 		if(argc != 3) goto args;
-        int fd = assertOpenTag(argv[2]);
-		tag_t ent = assertReadTag(fd);
-        close(fd);
-		printf("name      %s\n"
-		       "dtype     %s\n"
-			   "quality   %s\n"
-			   "timestamp %s\n"
-			   "value     %s\n",
-			argv[2], 
-			tag_dtype_toStrHR(&ent), 
-			tag_quality_toStrHR(&ent, false), 
-			tag_timestamp_toStrHR(&ent),
-			tag_value_toStrHR(&ent));
+		readtag(argv[2]);
 	}
 	else if(0 == strcmp(argv[1], "sv"))
 	{
@@ -0,0 +1,284 @@
+/*	Copyright (C) 2018, 2020 Harris M. Snyder
+
+	This file is part of Tagfd.
+
+	Tagfd is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Tagfd is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Tagfd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+
+    tfdbench: a contention benchmark for tagfd. 
+    
+    One thread writes a tag as fast as it can, while a number of reader 
+    threads (each with their own file descriptor) read it as fast as they 
+    can. At the end, the write and read rates are printed, along with the
+    average time taken by a write. Running this against different versions
+    of the kernel module (or with different numbers of readers) shows how 
+    much readers and writers get in each other's way. 
+    
+    With -l, it measures wakeup latency instead: the readers block waiting 
+    for the tag, and the writer writes it once a millisecond. Each reader 
+    records how long it took from the write (its timestamp) to read() 
+    returning the new value. This is repeated with 1, 2, 4, ... up to 
+    [readers] readers, to show how wakeups scale with the number of 
+    watchers on one tag. 
+    
+    The tag must already exist, and you must be allowed to write it. Its 
+    value is left as it was, only the timestamp changes. 
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+// Defining this macro suppresses some of the stuff in the rule toolkit that 
+// would break this program. 
+#define __I_AM_NOT_A_RULE__ 1
+#define NO_SYSLOG 1 // some toolkit functions use the syslog. We don't want to. 
+#include "ruletoolkit.h"
+
+#include "tagfd-toolkit.h"
+
+
+static const char * g_tagName = NULL;
+static volatile bool g_stop = false;
+
+struct reader
+{
+    pthread_t thread;
+    int       fd;
+    uint64_t  reads;
+    
+    // latency mode
+    uint64_t  latencySum;
+    uint64_t  latencyMax;
+};
+
+
+void usage(void)
+{
+    puts("Usage: tfdbench [-r readers] [-s seconds] [-l] [tag-name]");
+    puts("");
+    puts("Writes the tag as fast as possible from one thread, while [readers] threads");
+    puts("(default 4) read it as fast as possible, for [seconds] seconds (default 5).");
+    puts("Prints the write rate, the read rate, and the average write latency.");
+    puts("");
+    puts("With -l, writes the tag once a millisecond while the readers wait for it,");
+    puts("and prints the average and worst wakeup latency (from the write to a ");
+    puts("reader getting the value), for 1, 2, 4, ... up to [readers] readers. ");
+    puts("[seconds] is then per number of readers.");
+    
+    exit(EXIT_SUCCESS);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (uint64_t)spec.tv_sec * 1000000000 + spec.tv_nsec;
+}
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec spec;
+    clock_gettime(CLOCK_REALTIME, &spec);
+    return (uint64_t)spec.tv_sec * 1000000000 + spec.tv_nsec;
+}
+
+// Latency mode reader: blocks for each new value, and records how old it is.
+static void * waiter_main(void * param)
+{
+    struct reader * r = param;
+    tagx_t tag;
+    
+    // the first read returns the value as it was when we opened the tag.
+    if(read(r->fd, &tag, sizeof(tagx_t)) != sizeof(tagx_t))
+        LogAbort(LOG_ERR, "Read from %s failed: %s", g_tagName, strerror(errno));
+    
+    while(1)
+    {
+        if(read(r->fd, &tag, sizeof(tagx_t)) != sizeof(tagx_t))
+            LogAbort(LOG_ERR, "Read from %s failed: %s", g_tagName, strerror(errno));
+        uint64_t latency = realtime_ns() - tag.timestamp_ns;
+        if(g_stop)
+            break;
+        r->reads++;
+        r->latencySum += latency;
+        if(latency > r->latencyMax)
+            r->latencyMax = latency;
+    }
+    
+    return NULL;
+}
+
+// Runs the latency benchmark with n readers, and prints a line of results.
+static void latency(int wfd, tagx_t * tag, int n, int seconds)
+{
+    struct reader * readers = calloc(n, sizeof(struct reader));
+    if(!readers)
+        LogAbort(LOG_ERR, "Allocation failed: %s", strerror(errno));
+    
+    g_stop = false;
+    for(int i = 0; i < n; i++)
+    {
+        readers[i].fd = assertOpenTag(g_tagName);
+        if(!setTagFlags(readers[i].fd, TAGFD_FLAG_EXTENDED))
+            LogAbort(LOG_ERR, "Couldn't set flags on %s: %s", g_tagName, strerror(errno));
+        if(pthread_create(&readers[i].thread, NULL, waiter_main, &readers[i]))
+            LogAbort(LOG_ERR, "Couldn't start reader thread");
+    }
+    
+    // let them all get to the point of waiting
+    usleep(100000);
+    
+    uint64_t writes = 0;
+    uint64_t end = now_ns() + (uint64_t)seconds * 1000000000;
+    while(now_ns() < end)
+    {
+        setTagTimestampNs(tag);
+        if(write(wfd, tag, sizeof(tagx_t)) != sizeof(tagx_t))
+            LogAbort(LOG_ERR, "Write to %s failed: %s", g_tagName, strerror(errno));
+        writes++;
+        usleep(1000);
+    }
+    
+    g_stop = true;
+    setTagTimestampNs(tag);
+    write(wfd, tag, sizeof(tagx_t));
+    
+    uint64_t reads = 0, sum = 0, max = 0;
+    for(int i = 0; i < n; i++)
+    {
+        pthread_join(readers[i].thread, NULL);
+        close(readers[i].fd);
+        reads += readers[i].reads;
+        sum += readers[i].latencySum;
+        if(readers[i].latencyMax > max)
+            max = readers[i].latencyMax;
+    }
+    free(readers);
+    
+    printf("%7d %9"PRIu64" %9"PRIu64" %12.0f %12"PRIu64"\n", n, writes, reads, reads ? sum / (double)reads : 0.0, max);
+}
+
+static void * reader_main(void * param)
+{
+    struct reader * r = param;
+    tagx_t tag;
+    
+    while(!g_stop)
+    {
+        if(read(r->fd, &tag, sizeof(tagx_t)) != sizeof(tagx_t))
+            LogAbort(LOG_ERR, "Read from %s failed: %s", g_tagName, strerror(errno));
+        r->reads++;
+    }
+    
+    return NULL;
+}
+
+int main(int argc, char ** argv)
+{
+    int nreaders = 4;
+    int seconds = 5;
+    bool latencyMode = false;
+    
+    // parse command line args. 
+    for(int i = 1; i < argc; i++)
+    {
+        if     (!strcmp(argv[i],"-r") && i+1 < argc) nreaders = atoi(argv[++i]);
+        else if(!strcmp(argv[i],"-s") && i+1 < argc) seconds = atoi(argv[++i]);
+        else if(!strcmp(argv[i],"-l"))               latencyMode = true;
+        else if(argv[i][0] != '-' && !g_tagName)     g_tagName = argv[i];
+        else usage();
+    }
+    if(!g_tagName || nreaders < 0 || seconds < 1) usage();
+    
+    // set up the writer
+    int wfd = assertOpenTag(g_tagName);
+    if(!setTagFlags(wfd, TAGFD_FLAG_EXTENDED))
+        LogAbort(LOG_ERR, "Couldn't set flags on %s: %s", g_tagName, strerror(errno));
+    tagx_t tag;
+    if(read(wfd, &tag, sizeof(tagx_t)) != sizeof(tagx_t))
+        LogAbort(LOG_ERR, "Read from %s failed: %s", g_tagName, strerror(errno));
+    
+    if(latencyMode)
+    {
+        printf("readers    writes     reads  avg wake ns  max wake ns\n");
+        for(int n = 1; n <= nreaders; n = (n * 2 > nreaders && n < nreaders) ? nreaders : n * 2)
+            latency(wfd, &tag, n, seconds);
+        close(wfd);
+        exit(EXIT_SUCCESS);
+    }
+    
+    // start the readers
+    struct reader * readers = calloc(nreaders ? nreaders : 1, sizeof(struct reader));
+    if(!readers)
+        LogAbort(LOG_ERR, "Allocation failed: %s", strerror(errno));
+    
+    for(int i = 0; i < nreaders; i++)
+    {
+        readers[i].fd = assertOpenTag(g_tagName);
+        if(!setTagFlags(readers[i].fd, TAGFD_FLAG_EXTENDED))
+            LogAbort(LOG_ERR, "Couldn't set flags on %s: %s", g_tagName, strerror(errno));
+        if(pthread_create(&readers[i].thread, NULL, reader_main, &readers[i]))
+            LogAbort(LOG_ERR, "Couldn't start reader thread");
+    }
+    
+    // write as fast as we can
+    uint64_t writes = 0;
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)seconds * 1000000000;
+    uint64_t t = start;
+    while(t < end)
+    {
+        setTagTimestampNs(&tag);
+        if(write(wfd, &tag, sizeof(tagx_t)) != sizeof(tagx_t))
+            LogAbort(LOG_ERR, "Write to %s failed: %s", g_tagName, strerror(errno));
+        writes++;
+        t = now_ns();
+    }
+    
+    // Stop the readers. They might be blocked waiting for a new value, so give them one. 
+    g_stop = true;
+    setTagTimestampNs(&tag);
+    write(wfd, &tag, sizeof(tagx_t));
+    
+    uint64_t reads = 0;
+    for(int i = 0; i < nreaders; i++)
+    {
+        pthread_join(readers[i].thread, NULL);
+        close(readers[i].fd);
+        reads += readers[i].reads;
+    }
+    free(readers);
+    close(wfd);
+    
+    double elapsed = (t - start) / 1e9;
+    printf("readers:        %d\n", nreaders);
+    printf("writes/s:       %.0f\n", writes / elapsed);
+    printf("reads/s:        %.0f (%.0f per reader)\n", reads / elapsed, nreaders ? reads / elapsed / nreaders : 0.0);
+    printf("write latency:  %.0f ns (average)\n", (t - start) / (double)writes);
+    
+    exit(EXIT_SUCCESS);
+}
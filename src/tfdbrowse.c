@@ -23,13 +23,14 @@
     Somewhat quick-and-dirty, but cleanup is low priority, as this is "just" a tool.
     
     You can run it with -a to automatically watch all tags. 
+    Watched tags are read through the shared tag table, and refreshed a few 
+    times a second, so watching lots of tags doesn't cost lots of system calls.
 	
 	Harris M. Snyder, 2018
 	
 	
 	TODO:
 	- Scrolling
-	- Alphabetical sort of live data list
     - Code cleanup (low priority)
 
 */
@@ -139,30 +140,6 @@ void add_fd(int fd, struct ancillary ancil)
 }
 
 
-// Removes a file descriptor from the list of those that we want to poll. 
-static 
-void rm_fd(int fd)
-{
-	// Iterate the fd list.
-	for(int i = 0; i < gl_n_fds; i++)
-	{
-		// When we find the matching structure...
-		if(gl_fds[i].fd == fd)
-		{
-			// Consolidate the list to remove gaps. 
-			int nmov = gl_n_fds - i - 1;
-			if(nmov > 0)
-			{
-				memmove(gl_fds + i, gl_fds + i + 1, sizeof(struct pollfd) * nmov);
-				memmove(gl_ancillary + i, gl_ancillary + i + 1, sizeof(struct ancillary) * nmov);
-			}
-			gl_n_fds--;
-			
-		}
-	}
-}
-
-
 
 // ====================================================================================
 //  REDPINEFD FUNCTIONS
@@ -172,6 +149,7 @@ struct tag_dev
 {
 	char name[TAG_NAME_LENGTH];
 	int watching;
+	int id; // ID in the shared tag table
 	tag_t tag;
 	
 };
@@ -193,69 +171,72 @@ struct binTree * gl_tagDevTree = NULL;
 static int gl_nTagDevs = 0;
 static int gl_nTagDevsWatched = 0;
 
-// Ugly, but... advance declaration for needed function 
-void draw_win_main(int inputevent);
-void process_data(struct pollfd * pfd, void * arg)
+static tag_table_t * gl_tagTable = NULL;
+
+// How often (ms) the values of watched tags are refreshed from the shared tag table.
+#define REFRESH_INTERVAL_MS 200
+
+// Starts watching a tag: looks up its ID and takes an initial reading. 
+static void watch_tag(struct tag_dev * ed)
 {
-	struct tag_dev * edev = (struct tag_dev *)arg;
-	ASSERT(sizeof(tag_t) == read(pfd->fd, &edev->tag, sizeof(tag_t)), "Failed to read tag %s", edev->name);
-	draw_win_main(-1);
+    tagTableRead(gl_tagTable, ed->id, &ed->tag);
+    ed->watching = 1;
+    gl_nTagDevsWatched++;
 }
 
+static void unwatch_tag(struct tag_dev * ed)
+{
+    ed->watching = 0;
+    gl_nTagDevsWatched--;
+}
 
 static void binTreeTraverse_addTag(struct tag_dev * ed, void * _)
 {
-    char namebuffer[PATH_MAX+100];
-    sprintf(namebuffer, "/dev/tagfd/%s", ed->name);
-    int fd = open(namebuffer, O_RDWR);
+    watch_tag(ed);
+}
+
+// Refreshes a watched tag from the shared table. The param is a bool that gets set if anything changed.
+static void binTreeTraverse_refreshTag(struct tag_dev * ed, void * param)
+{
+    if(!ed->watching) return;
     
-    ASSERT(fd > 0, "Failed to open %n", ed->name);
-    struct ancillary anc = {.pollinHandler = process_data, .handlerArg = ed};
-    add_fd(fd, anc);
-    ed->watching = fd;
-    gl_nTagDevsWatched++;
+    tag_t latest;
+    if(tagTableRead(gl_tagTable, ed->id, &latest) && memcmp(&latest, &ed->tag, sizeof(tag_t)))
+    {
+        ed->tag = latest;
+        *(bool*)param = true;
+    }
+}
+
+// listTags callback: adds a tag to the tree.
+static int listTag(void * param, int id, const char * name, const tagx_t * tag)
+{
+	struct tag_dev edv ;
+	memset(&edv,0,sizeof(edv));
+	strcpy(edv.name, name);
+	edv.id = id;
+	edv.tag = tag->tag;
+	binTree_insert(&gl_tagDevTree, edv);
+	gl_nTagDevs++;
+	return 0;
 }
 
 static 
 void setupTagList(bool add_all)
 {
-
-	DIR * devdir = opendir("/dev/tagfd"); 
-	if(!devdir) return;
 	gl_nTagDevs = 0;
 	
-	// Walk the /dev/tagfd directory
-	while(1)
+	// Get all of the tags in one go
+	if(listTags(NULL, NULL, listTag) < 0)
 	{
-		struct dirent * entry = readdir(devdir);
-		if(!entry) break;
-		
-		char pathbuf [PATH_MAX+100];
-		sprintf(pathbuf, "/dev/tagfd/%s", entry->d_name);
-		struct stat statbuf;
-		if (lstat(pathbuf, &statbuf) < 0)
-		{
-			fprintf(stderr, "Couldn't stat %s, check permissions.\n", pathbuf);
-		}
-		else
-		{
-			if(S_ISCHR(statbuf.st_mode))
-			{
-				struct tag_dev edv ;
-				memset(&edv,0,sizeof(edv));
-				strcpy(edv.name, entry->d_name);
-				binTree_insert(&gl_tagDevTree, edv);
-				gl_nTagDevs++;
-			}
-		}
+		fprintf(stderr, "Couldn't list tags from /proc/tagfd/tags: %s\n", strerror(errno));
+		return;
 	}
 	
     if(add_all)
     {
         binTree_orderedTraverse(gl_tagDevTree, binTreeTraverse_addTag, NULL);
     }
-    
-	closedir(devdir);
 }
 
 // ====================================================================================
@@ -349,6 +330,21 @@ void printTag(struct tag_dev * ed, void * param)
 	context->count++;
 }
 
+// Callback function for traversal of the binary tree of tag_devs - prints the watched ones' values to the main window. 
+void printLiveTag(struct tag_dev * ed, void * param)
+{
+	struct tagBinTreeTraverseContext * context = (struct tagBinTreeTraverseContext *) param;
+	
+	if(!ed->watching) return;
+	
+	if(context->count == context->ofInterest)
+		wattron(gl_win_main, A_REVERSE);
+	wprintw(gl_win_main, "%-8s  %21s  %21s  %s\n", tag_quality_toStrHR(&ed->tag, true), tag_timestamp_toStrHR(&ed->tag), tag_value_toStrHR(&ed->tag), ed->name );
+	wattroff(gl_win_main, A_REVERSE);
+	
+	context->count++;
+}
+
 // Callback function for traversal of the binary tree of tag_devs - locates the nth element (ordered by name). 
 void nthTag(struct tag_dev * ed, void * param)
 {
@@ -401,24 +397,9 @@ void draw_win_main(int inputevent)
 				
 				// is the tag already selected?
 				if(travCtx.output->watching)
-				{
-					close(travCtx.output->watching);
-					rm_fd(travCtx.output->watching);
-					travCtx.output->watching = 0;
-					gl_nTagDevsWatched--;
-				}
+					unwatch_tag(travCtx.output);
 				else
-				{
-					char namebuffer[PATH_MAX+100];
-					sprintf(namebuffer, "/dev/tagfd/%s", travCtx.output->name);
-					int fd = open(namebuffer, O_RDWR);
-					
-					ASSERT(fd > 0, "Failed to open %n", travCtx.output->name);
-					struct ancillary anc = {.pollinHandler = process_data, .handlerArg = travCtx.output};
-					add_fd(fd, anc);
-					travCtx.output->watching = fd;
-					gl_nTagDevsWatched++;
-				}
+					watch_tag(travCtx.output);
 			}
 			break;
 		
@@ -461,31 +442,8 @@ void draw_win_main(int inputevent)
 	{
 		SET_LIMIT(gl_nTagDevsWatched);
 		
-		int count = -2;
-		for(int i = 0; i < gl_n_fds; i++)
-		{
-			if(gl_ancillary[i].handlerArg)
-			{
-				if(count < 0) count = 0;
-				else count++;
-			}
-			else
-			{
-				continue;
-			}
-			
-			struct tag_dev * edev = (struct tag_dev *) gl_ancillary[i].handlerArg;
-			
-			if(count == hilight)
-			{
-				wattron(gl_win_main, A_REVERSE);
-			}
-			//wprintw(gl_win_main, "%-23s   %-20s   %-23s   %s\n", tag_valueToStr(&edev->tag), tag_qualityToStr(&edev->tag), tag_timestampToStr(&edev->tag), edev->name);
-			//wprintw(gl_win_main, "%-*s   %-21s   %-21s   %-10s\n", gl_cols-67, edev->name, tag_valueToStr(&edev->tag), tag_timestampToStr(&edev->tag), tag_qualityToStr(&edev->tag));
-			wprintw(gl_win_main, "%-8s  %21s  %21s  %s\n", tag_quality_toStrHR(&edev->tag, true), tag_timestamp_toStrHR(&edev->tag), tag_value_toStrHR(&edev->tag), edev->name );
-			wattroff(gl_win_main, A_REVERSE);
-			
-		}
+		struct tagBinTreeTraverseContext printContext = {.count = 0, .ofInterest = hilight};
+		binTree_orderedTraverse(gl_tagDevTree, printLiveTag, &printContext);
 	}
 	
 	else
@@ -622,6 +580,8 @@ void my_atexit(void)
 	
 	if(gl_tagDevTree)
 		binTree_clear(gl_tagDevTree);
+	
+	tagTableClose(gl_tagTable);
 }
 
 int main(int argc, char ** argv)
@@ -630,6 +590,9 @@ int main(int argc, char ** argv)
 	add_fd(STDIN_FILENO, anc );
 	atexit(my_atexit);
 	
+	gl_tagTable = tagTableOpen();
+	ASSERT(gl_tagTable, "Failed to map the shared tag table%s", "");
+	
     bool add_all = argc > 1 && !strcmp(argv[1],"-a");
     if(add_all) gl_selectedTabIndex = TAB_LIVE_DATA;
 	setupTagList(add_all);
@@ -649,7 +612,7 @@ int main(int argc, char ** argv)
 	while(1)
 	{
 		// Poll event descriptors
-		if(0 > poll(gl_fds, gl_n_fds, -1)) 
+		if(0 > poll(gl_fds, gl_n_fds, REFRESH_INTERVAL_MS)) 
 		{
 			if(errno == EINTR) // interrupted by a signal: probably window resize. 
 			{
@@ -680,6 +643,12 @@ int main(int argc, char ** argv)
 			}
 		}
 		
+		// Refresh the watched tags.
+		bool changed = false;
+		binTree_orderedTraverse(gl_tagDevTree, binTreeTraverse_refreshTag, &changed);
+		if(changed)
+			draw_win_main(-1);
+		
 	}
 
 	exit(EXIT_SUCCESS);
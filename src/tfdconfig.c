@@ -63,6 +63,14 @@
 #define STRLEN STR2(TAG_STRING_VALUE_LENGTH)
 
 
+// A creation (or delete, or retype) request, as written to /dev/tagfd.master.
+union tag_request
+{
+    struct tag_config       config;
+    struct tag_timer_config timer;
+    struct tag_array_config array;
+};
+
 static const char * validTagNameChars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_";
 
 _Static_assert(BUFSZ > TAG_NAME_LENGTH, "BUFSZ must be greater thatn TAG_NAME_LENGTH.");
@@ -70,12 +78,21 @@ _Static_assert(BUFSZ > TAG_NAME_LENGTH, "BUFSZ must be greater thatn TAG_NAME_LE
 
 void usage()
 {
-    puts("Usage: tfdconfig [action] [data type] [name]");
-    puts("This is the exact order and number of arguments. None are optional.");
+    puts("Usage: tfdconfig [action] [data type] [name] [period]");
+    puts("   or: tfdconfig - [name]");
+    puts("   or: tfdconfig f [config file]");
+    puts("   or: tfdconfig ft [config file]");
+    puts("This is the exact order of arguments. Only [period] is optional.");
     puts("");
-    puts("[action]    Can be '+' (for 'add tag') or 't' (for 'test command').");
-    puts("            Test command allows you to try a set of arguments without");
-    puts("            actually creating a tag. ");
+    puts("The second form deletes a tag. The third creates every tag in a config");
+    puts("file (one tag per line, as [data type] [name] [period], see ");
+    puts("cfg/tagfd.conf), all in one go. The fourth only checks the file. If ");
+    puts("any line is invalid, no tags are created.");
+    puts("");
+    puts("[action]    Can be '+' (for 'add tag'), '~' (for 'change the data type");
+    puts("            of an existing tag', which resets its value to zero), or 't'");
+    puts("            (for 'test command'). Test command allows you to try a set");
+    puts("            of arguments without actually creating a tag. ");
     puts("");
     puts("[data type] Can be one of: int8, uint8, int16, uint16, int32, uint32, ");
     puts("            int64, uint64, real32, real64, timestamp, string. The int ");
@@ -84,14 +101,149 @@ void usage()
     puts("            uint64, but represents a timestamp in epoch-milliseconds UTC.");
     puts("            String is a text string of at most "STRLEN" bytes (or a");
     puts("            binary blob of up to that size).");
+    puts("            Any of them but string can be followed by a length in");
+    puts("            brackets, e.g. real32[4096], to make an array tag: one");
+    puts("            that holds that many values (at most 1 MiB of data), all");
+    puts("            read and written at once. Array tags can't be retyped.");
     puts("");
     puts("[name]      is the name of the tag to be created. Valid tag names can");
     puts("            consist of alphanumeric characters plus any of .-_");
+    puts("");
+    puts("[period]    makes the tag a timer tag, which the kernel module adds 1");
+    puts("            to once every period. Give a number followed by s, ms or");
+    puts("            us, e.g. 1s, 100ms or 250us (at least 100us). Timer tags");
+    puts("            must have an unsigned int data type, and can't be arrays.");
     exit(EXIT_FAILURE);
 }
 
 
-void go (const char * name, uint8_t dtype)
+// Parses a period like "1s", "100ms" or "250us" to nanoseconds. Returns 0 if 
+// it's invalid.
+uint64_t parsePeriod(const char * str)
+{
+    char * end;
+    errno = 0;
+    unsigned long long n = strtoull(str, &end, 10);
+    if(errno || end == str || !isdigit((unsigned char)str[0]))
+        return 0;
+    
+    uint64_t unit;
+    if      (!strcmp(end, "s"))  unit = 1000000000;
+    else if (!strcmp(end, "ms")) unit = 1000000;
+    else if (!strcmp(end, "us")) unit = 1000;
+    else return 0;
+    
+    if(n > UINT64_MAX / unit)
+        return 0;
+    return n * unit;
+}
+
+// Parses a data type, which may be an array like "real32[4096]", in which case 
+// *length is set to its length (otherwise it's 0). Returns DT_INVALID if it's 
+// invalid. 
+uint8_t parseDtype(const char * str, uint32_t * length)
+{
+    char buf [BUFSZ];
+    const char * bracket = strchr(str, '[');
+    
+    *length = 0;
+    if(bracket == NULL)
+        return tag_dtype_fromStrHR(str);
+    
+    snprintf(buf, BUFSZ, "%.*s", (int)(bracket - str), str);
+    uint8_t dtype = tag_dtype_fromStrHR(buf);
+    
+    char * end;
+    errno = 0;
+    unsigned long n = strtoul(bracket + 1, &end, 10);
+    size_t elementSize = tagArrayElementSize(dtype);
+    if(errno || end == bracket + 1 || !isdigit((unsigned char)bracket[1]) || strcmp(end, "]") || 
+       n == 0 || elementSize == 0 || n > TAGFD_ARRAY_MAX_BYTES / elementSize)
+        return DT_INVALID;
+    
+    *length = n;
+    return dtype;
+}
+
+// Checks one tag's arguments, and fills in its creation request. Prints what's wrong and 
+// returns false if they aren't valid. period may be NULL, and so may dtypeStr (for a delete). 
+bool check (const char * dtypeStr, const char * name, const char * period, union tag_request * req)
+{
+    struct tag_config * ecfg = &req->config;
+    memset(req, 0, sizeof(union tag_request));
+    
+    uint8_t dtype = DT_INVALID;
+    uint32_t length = 0;
+    if(dtypeStr && (dtype = parseDtype(dtypeStr, &length)) == DT_INVALID)
+    {
+        printf("Unrecognized data type. \n");
+        return false;
+    }
+    
+    // validate name
+    if(strlen(name) < 1)
+    {
+        printf("Name too short.\n");
+        return false;
+    }
+    
+    if(!strcmp(name, ".") || !strcmp(name, ".."))
+    {
+        printf("Invalid name.\n");
+        return false;
+    }
+    
+    if(strlen(name) > TAG_NAME_LENGTH - 1)
+    {
+        printf("Name too long.\n");
+        return false;
+    }
+    
+    for (int i = 0; i < strlen (name); i++)
+    {
+        if(!strchr(validTagNameChars,name[i]))
+        {
+            printf("Invalid name.\n");
+            return false;
+        }	
+    }
+    
+    if(period)
+    {
+        req->timer.period_ns = parsePeriod(period);
+        if(req->timer.period_ns < TAGFD_TIMER_MIN_NS)
+        {
+            printf("Invalid period.\n");
+            return false;
+        }
+        if(length || (dtype != DT_UINT8 && dtype != DT_UINT16 && dtype != DT_UINT32 && dtype != DT_UINT64))
+        {
+            printf("Timer tags must have an unsigned int data type (and can't be arrays).\n");
+            return false;
+        }
+    }
+    
+    ecfg->action = period ? TAGFD_ACTION_TIMER : length ? TAGFD_ACTION_ARRAY : '+';
+    ecfg->dtype = dtype;
+    req->array.length = length;
+    strncpy(ecfg->name, name, TAG_NAME_LENGTH-1);
+    return true;
+}
+
+// The size of a creation request, as written to /dev/tagfd.master. 
+size_t requestSize (const union tag_request * req)
+{
+    switch(req->config.action)
+    {
+        case TAGFD_ACTION_TIMER: return sizeof(struct tag_timer_config);
+        case TAGFD_ACTION_ARRAY: return sizeof(struct tag_array_config);
+        default:                 return sizeof(struct tag_config);
+    }
+}
+
+// Sends len bytes of requests to /dev/tagfd.master in one write. verb and done say what 
+// the requests do, e.g. "create" and "Created". 
+void go (const void * requests, size_t len, const char * verb, const char * done, const char * what)
 {
 	int fd = open("/dev/tagfd.master", O_WRONLY);
 	if(fd < 0)
@@ -99,78 +251,155 @@ void go (const char * name, uint8_t dtype)
 		printf("Couldn't open /dev/tagfd.master: %s\n", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
-    
-	struct tag_config ecfg;
-	memset(&ecfg, 0, sizeof(struct tag_config));
-	
-	ecfg.action = '+';
-	ecfg.dtype = dtype;
-	strncpy(ecfg.name, name, TAG_NAME_LENGTH-1);
 	
-	
-	int rc = write(fd, &ecfg, sizeof(struct tag_config));
+	ssize_t rc = write(fd, requests, len);
 	if(rc < 0)
 	{
-		printf("Failed to create %s (%"PRIu8"): %s\n", name, dtype, strerror(errno));
+		printf("Failed to %s %s: %s\n", verb, what, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if(rc < len)
+	{
+		printf("Only managed to %s part of %s (the tags before the first that failed).\n", verb, what);
 		exit(EXIT_FAILURE);
 	}
 	
-	printf("Created %s (%"PRIu8")\n", name, dtype);
+	printf("%s %s\n", done, what);
 	
 	close(fd);
 }
 
-int main(int argc, char ** argv)
+// Creates (or just checks, if test is set) every tag in a config file, with all of 
+// them in a single write to /dev/tagfd.master. Each line of the file holds the 
+// arguments for one tag: [data type] [name] [period], with [period] optional. 
+// Blank lines and lines starting with # are skipped. 
+void goFile (const char * path, bool test)
 {
-    if(argc != 4) usage();
-    
-    #define CREATE 1
-    #define TEST 2
-    int mode = CREATE;
+    FILE * f = fopen(path, "r");
+    if(f == NULL)
+    {
+        printf("Couldn't open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
     
-    if      (!strcmp(argv[1], "+")) mode = CREATE;
-    else if (!strcmp(argv[1], "t")) mode = TEST;
-    else usage();
+    char * requests = NULL;
+    size_t len = 0, cap = 0;
+    int ln = 0, ntags = 0;
+    bool ok = true;
+    char buf [BUFSZ];
     
-    uint8_t dtype = tag_dtype_fromStrHR(argv[2]);
-    if(dtype == DT_INVALID)
+    while(fgets(buf, BUFSZ, f))
     {
-        printf("Unrecognized data type. \n");
-        exit(EXIT_FAILURE);
+        ln++;
+        char dtbuf [BUFSZ], nbuf [BUFSZ], pbuf [BUFSZ], extra [BUFSZ];
+        int n = sscanf(buf, "%s %s %s %s", dtbuf, nbuf, pbuf, extra);
+        if(n <= 0 || dtbuf[0] == '#')
+            continue;
+        
+        union tag_request req;
+        if(n < 2 || n > 3)
+        {
+            printf("%s line %d: Expected [data type] [name] [period].\n", path, ln);
+            ok = false;
+            continue;
+        }
+        if(!check(dtbuf, nbuf, n == 3 ? pbuf : NULL, &req))
+        {
+            printf("%s line %d: Invalid tag.\n", path, ln);
+            ok = false;
+            continue;
+        }
+        
+        size_t sz = requestSize(&req);
+        if(len + sz > cap)
+        {
+            cap = cap ? cap * 2 : BUFSZ * sizeof(union tag_request);
+            requests = realloc(requests, cap);
+            if(requests == NULL)
+            {
+                printf("Out of memory.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(requests + len, &req, sz);
+        len += sz;
+        ntags++;
     }
     
-    // validate name
-    if(strlen(argv[3]) < 1)
+    if(ferror(f))
     {
-        printf("Name too short.\n");
+        printf("Couldn't read %s: %s\n", path, strerror(errno));
         exit(EXIT_FAILURE);
     }
+    fclose(f);
+    
+    if(!ok)
+        exit(EXIT_FAILURE);
     
-    if(!strcmp(argv[3], ".") || !strcmp(argv[3], ".."))
+    snprintf(buf, BUFSZ, "%d tags from %s", ntags, path);
+    if(test)
+        printf("Test OK for: %s\n", buf);
+    else if(ntags > 0)
+        go(requests, len, "create", "Created", buf);
+    
+    free(requests);
+}
+
+int main(int argc, char ** argv)
+{
+    if(argc == 3 && (!strcmp(argv[1], "f") || !strcmp(argv[1], "ft")))
     {
-        printf("Invalid name.\n");
+        goFile(argv[2], !strcmp(argv[1], "ft"));
+        exit(EXIT_SUCCESS);
     }
     
-    if(strlen(argv[3]) > TAG_NAME_LENGTH - 1)
+    union tag_request req;
+    char what [BUFSZ];
+    
+    if(argc == 3 && !strcmp(argv[1], "-"))
     {
-        printf("Name too long.\n");
-        exit(EXIT_FAILURE);
+        if(!check(NULL, argv[2], NULL, &req))
+            exit(EXIT_FAILURE);
+        req.config.action = TAGFD_ACTION_DELETE;
+        go(&req, requestSize(&req), "delete", "Deleted", argv[2]);
+        exit(EXIT_SUCCESS);
     }
     
-    for (int i = 0; i < strlen (argv[3]); i++)
+    if(argc != 4 && argc != 5) usage();
+    
+    #define CREATE 1
+    #define TEST 2
+    #define RETYPE 3
+    int mode = CREATE;
+    
+    if      (!strcmp(argv[1], "+")) mode = CREATE;
+    else if (!strcmp(argv[1], "t")) mode = TEST;
+    else if (!strcmp(argv[1], "~")) mode = RETYPE;
+    else usage();
+    
+    if(mode == RETYPE && argc != 4) usage();
+    
+    if(!check(argv[2], argv[3], argc == 5 ? argv[4] : NULL, &req))
+        exit(EXIT_FAILURE);
+    
+    if(mode == RETYPE && req.config.action == TAGFD_ACTION_ARRAY)
     {
-        if(!strchr(validTagNameChars,argv[3][i]))
-        {
-            printf("Invalid name.\n");
-            exit(EXIT_FAILURE);
-        }	
+        printf("Array tags can't be retyped.\n");
+        exit(EXIT_FAILURE);
     }
     
     // TODO: check if already exists. 
     
     if(mode == CREATE)
     {
-        go(argv[3], dtype);
+        snprintf(what, BUFSZ, "%s (%"PRIu8")", argv[3], req.config.dtype);
+        go(&req, requestSize(&req), "create", "Created", what);
+    }
+    else if(mode == RETYPE)
+    {
+        req.config.action = TAGFD_ACTION_RETYPE;
+        snprintf(what, BUFSZ, "%s (%"PRIu8")", argv[3], req.config.dtype);
+        go(&req, requestSize(&req), "retype", "Retyped", what);
     }
     else
         printf("Test OK for: %s\n", argv[3]);
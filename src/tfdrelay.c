@@ -39,22 +39,25 @@
 
 #include "tagfd-toolkit.h"
 
-#include <sys/poll.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 
 
+// the tags we're relaying. 
+struct relay_tag
+{
+    int     id;    // tag ID (see getTagId)
+    uint8_t dtype;
+};
+
 // import a vector data type - uses a simple macro based template system for C
-// specialize the vector for struct pollfd. 
-// and we want it to close the file descriptors when they get removed.
-#define TYPE struct pollfd
-#define PREFIX fd
+// specialize the vector for our tags. 
+#define TYPE struct relay_tag
+#define PREFIX rt
 #define TEMPLATE_DECL
 #define TEMPLATE_DEF
-#define SVDESTRUCTOR pollfd_destructor
-void pollfd_destructor(struct pollfd * pfd) { close(pfd->fd); }
 #include "templates/smallvector.h"
 
 // we want another specialization of this data type that can take strings
@@ -67,18 +70,14 @@ void pollfd_destructor(struct pollfd * pfd) { close(pfd->fd); }
 void s_metafree(char** ptr){free(*ptr);}
 #include "templates/smallvector.h"
 
-// we want another specialization of this data type that can take tags
-#define TYPE tag_t
-#define PREFIX t
-#define TEMPLATE_DECL
-#define TEMPLATE_DEF
-#include "templates/smallvector.h"
 
 
 struct svec   g_argv;
 
 struct svec   g_tagNames;
-struct fdvec  g_fds;
+struct rtvec  g_tags;
+int         * g_indexOf = NULL; // tag ID -> index in g_tags
+int           g_subFd = -1;
 
 bool          g_opt_dash_a = false; // -a flag was passed. 
 bool          g_opt_dash_n = false; // -n flag was passed.
@@ -103,73 +102,27 @@ void usage(void)
 }
 
 
-// directory walking callback for finding tags
-int findTags(void* param, const char * name, const char * path, struct stat sb)
+// tag listing callback for finding tags (used with -a)
+int findTags(void* param, int id, const char * name, const tagx_t * tag)
 {
-    // make sure we're looking at a char device.
-    if(!S_ISCHR(sb.st_mode)) return 0;
-
-    // unless we're adding all tags...
-    if(!g_opt_dash_a)
-    {
-        // scan the argv list to see if we're supposed to be adding this tag. 
-        for(int i = 0 ; i < svec_size(&g_argv); i++)
-        {
-            if(!strcmp(name, svec_ptr(&g_argv)[i]))
-            {
-                // remove it from the vector 
-                svec_remove(&g_argv, i);
-                goto proceed;
-            }
-        }
-        // this tag isn't on our list so skip it. 
-        return 0;
-    }
-    
-    proceed:
-
     if(!svec_append(&g_tagNames, strdup(name)))
     {
         printf("Error: failed vector append: %s\n", strerror(errno));
         return -1;
     }
     
-    struct pollfd pfd = {
-        .events = POLLIN, 
-        .revents = 0, 
-        .fd = open(path, O_RDONLY)
-    };
-    
-    if(pfd.fd < 0)
-    {
-        printf("Error: failed to open %s: %s\n", path, strerror(errno));
-        return -1;
-    }
-    
-    if(!fdvec_append(&g_fds, pfd))
-    {
-        printf("Error: failed vector append: %s\n", strerror(errno));
-        return -1;
-    }
-        
     return 0;
 }
 
 
-// directory walking callback for stat failure 
-int cantStat(void* param, const char * name, const char * path)
-{
-    printf("Error: can't stat %s: %s\n", path, strerror(errno));
-    return -1;
-}
-
-
 // called on exit. 
 void cleanup(void)
 {
     svec_destroy(&g_argv);
     svec_destroy(&g_tagNames);
-    fdvec_destroy(&g_fds);
+    rtvec_destroy(&g_tags);
+    free(g_indexOf);
+    if(g_subFd >= 0) close(g_subFd);
 }
 
 
@@ -195,11 +148,14 @@ int main(int argc, char ** argv)
 {
     svec_init(&g_argv);
     svec_init(&g_tagNames);
-    fdvec_init(&g_fds);
+    rtvec_init(&g_tags);
     
     atexit(cleanup);
     
-    signal(SIGINT, sigint_handler);
+    // no SA_RESTART: we want SIGINT to interrupt the blocking read() below.
+    struct sigaction sa = { .sa_handler = sigint_handler };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
     
     if(argc < 2) usage();
     
@@ -218,95 +174,137 @@ int main(int argc, char ** argv)
         }
     }
         
-    // walk the tag directory to find tags. 
-    const char * errMsg ; 
-    int wrc = walkDirectory("/dev/tagfd", NULL, NULL, &errMsg, findTags, cantStat);
-    if(wrc == 1) exit(EXIT_FAILURE);
-    if(wrc == -1)
+    if(g_opt_dash_a)
+    {
+        // list all of the tags. 
+        int lrc = listTags(NULL, NULL, findTags);
+        if(lrc == 1) exit(EXIT_FAILURE);
+        if(lrc == -1)
+        {
+            printf("Error: failed to list tags from /proc/tagfd/tags: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
     {
-        printf("Error: %s failed when trying to walk /dev/tagfd: %s\n", errMsg, strerror(errno));
+        // the tags we want are the ones on the command line. 
+        struct svec tmp = g_tagNames;
+        g_tagNames = g_argv;
+        g_argv = tmp;
+    }
+    
+    // Look up the tags' IDs by name, and read them all in one go to get their data types.
+    int bulkfd = openBulk();
+    if(bulkfd < 0)
+    {
+        printf("Error: failed to open bulk device: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
     
-    // check for unfound tags.
-    for(int i = 0; i < svec_size(&g_argv); i++)
+    const int ntags = svec_size(&g_tagNames);
+    struct tag_bulk_entry * entries = calloc(ntags ? ntags : 1, sizeof(struct tag_bulk_entry));
+    if(!entries)
     {
-        printf("Error: Tag not found: %s\n", svec_ptr(&g_argv)[i]);
+        printf("Error: allocation failed: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
     
-    // Output the index-tagname association list. 
-    // We need to store the values in this loop because our "protocol" requires us to output those separately. 
-    struct tvec tags;
-    tvec_init(&tags);
-    for(int i = 0; i < fdvec_size(&g_fds); i++)
+    for(int i = 0; i < ntags; i++)
     {
-        struct pollfd pfd = fdvec_ptr(&g_fds)[i];
-        char * tagname = svec_ptr(&g_tagNames)[i];
-        
-        tag_t tag;
-        if(sizeof(tag_t) != read(pfd.fd, &tag, sizeof(tag_t)))
+        int id = lookupTagId(bulkfd, svec_ptr(&g_tagNames)[i]);
+        if(id < 0)
         {
-            printf("Error: failed to read tag %s: %s", tagname , strerror(errno));
+            if(errno == ENOENT)
+                printf("Error: Tag not found: %s\n", svec_ptr(&g_tagNames)[i]);
+            else
+                printf("Error: failed to look up tag %s: %s\n", svec_ptr(&g_tagNames)[i], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        entries[i].id = id;
+    }
+    
+    if(!bulkReadTags(bulkfd, entries, ntags))
+    {
+        printf("Error: bulk read failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(bulkfd);
+    
+    for(int i = 0; i < ntags; i++)
+    {
+        if(entries[i].status < 0)
+        {
+            printf("Error: failed to read tag %s: %s\n", svec_ptr(&g_tagNames)[i], strerror(-entries[i].status));
             exit(EXIT_FAILURE);
         }
         
-        if(!tvec_append(&tags, tag))
+        struct relay_tag rt = { .id = entries[i].id, .dtype = entries[i].tag.tag.dtype };
+        if(!rtvec_append(&g_tags, rt))
         {
             printf("Error: Vector append failed: %s\n", strerror(errno));
             exit(EXIT_FAILURE);
         }
-        
-        printf("a %d %s %d\n", i, tagname, tag.dtype);
+    }
+    free(entries);
+    
+    // Output the index-tagname association list. 
+    int maxId = 0;
+    for(int i = 0; i < rtvec_size(&g_tags); i++)
+    {
+        struct relay_tag rt = rtvec_ptr(&g_tags)[i];
+        if(rt.id > maxId) maxId = rt.id;
+        printf("a %d %s %d\n", i, svec_ptr(&g_tagNames)[i], rt.dtype);
     }
     printf("\n");
     
-    // Output initial values. 
-    for(int i = 0; i < tvec_size(&tags); i++)
+    // Subscribe to all of our tags on a single file descriptor. 
+    g_indexOf = calloc(maxId + 1, sizeof(int));
+    if(!g_indexOf)
     {
-        if(g_opt_dash_n)
-            tag_print_name(tvec_ptr(&tags)[i], svec_ptr(&g_tagNames)[i]);
-        else
-            tag_print_index(tvec_ptr(&tags)[i], i);
+        printf("Error: allocation failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
     }
     
-    tvec_destroy(&tags); // don't need this anymore. 
+    g_subFd = openSubscription();
+    if(g_subFd < 0)
+    {
+        printf("Error: failed to open subscription device: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
     
-    // poll forever. 
+    for(int i = 0; i < rtvec_size(&g_tags); i++)
+    {
+        int id = rtvec_ptr(&g_tags)[i].id;
+        g_indexOf[id] = i;
+        if(!subscribeTag(g_subFd, id))
+        {
+            printf("Error: failed to subscribe to tag %s: %s\n", svec_ptr(&g_tagNames)[i], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // Stream forever. Each tag is reported once when it's subscribed to, 
+    // so the initial values come out first, in index order. 
+    struct tag_record records[256];
     while(!g_sigint)
     {
-        int rc = poll(fdvec_ptr(&g_fds), fdvec_size(&g_fds), -1);
-        if(rc < 1)
+        ssize_t rc = read(g_subFd, records, sizeof(records));
+        if(rc < 0)
         {
             if(errno == EINTR) continue;
             
-            printf("Error: poll failed: %s\n", strerror(errno));
+            printf("Error: read from subscription failed: %s\n", strerror(errno));
             exit(EXIT_FAILURE);
         }
         
-        for(int i = 0; i < fdvec_size(&g_fds); i++)
+        for(int j = 0; j < rc / sizeof(struct tag_record); j++)
         {
-            struct pollfd pfd = fdvec_ptr(&g_fds)[i];
-            char * tagname = svec_ptr(&g_tagNames)[i];
-            if(pfd.revents == POLLIN || pfd.revents == (POLLIN & POLLRDNORM))
-            {
-                tag_t tag;
-                if(sizeof(tag_t) != read(pfd.fd, &tag, sizeof(tag_t)))
-                {
-                    printf("Error: failed to read tag %s: %s", tagname , strerror(errno));
-                    exit(EXIT_FAILURE);
-                }
-                if(g_opt_dash_n)
-                    tag_print_name(tag, tagname);
-                else
-                    tag_print_index(tag, i);
-                
-            }
-            else if(pfd.revents)
-            {
-                printf("Error: unexpected revents on tag %s: %d\n", tagname, pfd.revents);
-                exit(EXIT_FAILURE);
-            }
+            if(records[j].id > maxId) continue; // can't happen
+            int i = g_indexOf[records[j].id];
+            if(g_opt_dash_n)
+                tag_print_name(records[j].tag.tag, svec_ptr(&g_tagNames)[i]);
+            else
+                tag_print_index(records[j].tag.tag, i);
         }
     }
     
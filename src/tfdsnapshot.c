@@ -0,0 +1,356 @@
+/*	Copyright (C) 2018, 2020 Harris M. Snyder
+
+	This file is part of Tagfd.
+
+	Tagfd is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Tagfd is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Tagfd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+
+    tfdsnapshot: saves the value of every tag to a file, and restores them.
+
+    Saving takes a consistent snapshot of all of the tags (see snapshotTags),
+    and writes it to a compact binary file: a header, then for each tag its
+    name (length first) followed by its tagx_t. The file is written to a
+    temporary name and renamed into place, so there's always a whole one.
+
+    Restoring matches the saved tags to the current ones by name, and writes
+    all of them in one bulk write, with their saved values, qualities and
+    timestamps. It's meant to be run at boot, straight after the tags are
+    created (tags that haven't been written yet take any timestamp). Tags
+    that no longer exist, have a different data type, or have been written
+    since they were created are skipped and counted.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "tagfd-shared.h"
+#include "tagfd-toolkit.h"
+
+
+#define SNAPSHOT_MAGIC   "TFDSNAP"
+#define SNAPSHOT_VERSION 1
+
+// The file starts with this, then has count records of:
+// uint8_t name length, the name (not null terminated), tagx_t.
+struct snapshot_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t tagSize; // sizeof(tagx_t), so a file from an incompatible build is refused
+    uint32_t reserved;
+};
+
+struct named_tag
+{
+    char   * name;
+    int      id;
+    tagx_t   tag;
+};
+
+struct tag_list
+{
+    struct named_tag * tags;
+    size_t             count;
+    size_t             cap;
+};
+
+
+void usage(void)
+{
+    puts("Usage: tfdsnapshot save [file]");
+    puts("   or: tfdsnapshot restore [file]");
+    puts("");
+    puts("save writes the value of every tag to [file]. restore writes the values");
+    puts("saved in [file] back to the tags with the same names, all at once. Run it");
+    puts("straight after the tags are created (e.g. at boot).");
+
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void * checkedRealloc(void * p, size_t sz)
+{
+    p = realloc(p, sz);
+    if(p == NULL)
+    {
+        printf("Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// listTags callback: collects every tag's ID and name.
+int collect(void * param, int id, const char * name, const tagx_t * tag)
+{
+    struct tag_list * list = param;
+
+    if(list->count == list->cap)
+    {
+        list->cap = list->cap ? list->cap * 2 : 1024;
+        list->tags = checkedRealloc(list->tags, list->cap * sizeof(struct named_tag));
+    }
+
+    struct named_tag * t = &list->tags[list->count++];
+    t->name = strdup(name);
+    t->id = id;
+    t->tag = *tag;
+    if(t->name == NULL)
+    {
+        printf("Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+static int compareNames(const void * a, const void * b)
+{
+    return strcmp(((const struct named_tag *)a)->name, ((const struct named_tag *)b)->name);
+}
+
+static void getTags(struct tag_list * list)
+{
+    memset(list, 0, sizeof(struct tag_list));
+    if(listTags(NULL, list, collect) < 0)
+    {
+        printf("Couldn't list the tags: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void openBulkOrDie(int * fd)
+{
+    *fd = openBulk();
+    if(*fd < 0)
+    {
+        printf("Couldn't open /dev/tagfd.bulk: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void save(const char * path)
+{
+    uint64_t start = now_ns();
+    struct tag_list list;
+    int bulkfd;
+
+    getTags(&list);
+    openBulkOrDie(&bulkfd);
+
+    // The listing isn't consistent across tags, so read the values again as a snapshot.
+    struct tag_bulk_entry * ents = calloc(list.count ? list.count : 1, sizeof(struct tag_bulk_entry));
+    if(ents == NULL)
+    {
+        printf("Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t i = 0; i < list.count; i++)
+        ents[i].id = list.tags[i].id;
+    if(list.count && !snapshotTags(bulkfd, ents, list.count))
+    {
+        printf("Couldn't read the tags: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(bulkfd);
+
+    char tmpPath [4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE * f = fopen(tmpPath, "wb");
+    if(f == NULL)
+    {
+        printf("Couldn't create %s: %s\n", tmpPath, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct snapshot_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.tagSize = sizeof(tagx_t);
+    for(size_t i = 0; i < list.count; i++)
+        hdr.count += ents[i].status == 0; // (deleted since the listing)
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    for(size_t i = 0; i < list.count; i++)
+    {
+        if(ents[i].status != 0)
+            continue;
+        uint8_t len = strlen(list.tags[i].name);
+        fwrite(&len, 1, 1, f);
+        fwrite(list.tags[i].name, 1, len, f);
+        fwrite(&ents[i].tag, sizeof(tagx_t), 1, f);
+    }
+
+    if(fflush(f) || fsync(fileno(f)) || ferror(f) || fclose(f))
+    {
+        printf("Couldn't write %s: %s\n", tmpPath, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if(rename(tmpPath, path))
+    {
+        printf("Couldn't rename %s to %s: %s\n", tmpPath, path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Saved %"PRIu32" tags to %s in %.3f ms\n", hdr.count, path, (now_ns() - start) / 1e6);
+}
+
+void restore(const char * path)
+{
+    uint64_t start = now_ns();
+    struct tag_list list;
+    int bulkfd;
+
+    // read the whole file in one go
+    FILE * f = fopen(path, "rb");
+    if(f == NULL)
+    {
+        printf("Couldn't open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    char * data = NULL;
+    size_t size = 0, cap = 0, n;
+    do
+    {
+        if(size == cap)
+        {
+            cap = cap ? cap * 2 : 1 << 20;
+            data = checkedRealloc(data, cap);
+        }
+        n = fread(data + size, 1, cap - size, f);
+        size += n;
+    } while(n > 0);
+    if(ferror(f))
+    {
+        printf("Couldn't read %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+
+    struct snapshot_header hdr;
+    if(size < sizeof(hdr))
+    {
+        printf("%s isn't a tag snapshot.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    if(memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) || hdr.version != SNAPSHOT_VERSION || hdr.tagSize != sizeof(tagx_t))
+    {
+        printf("%s isn't a tag snapshot (or it's from an incompatible version).\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    // match the saved tags to the ones that exist now, by name
+    getTags(&list);
+    qsort(list.tags, list.count, sizeof(struct named_tag), compareNames);
+
+    struct tag_bulk_entry * ents = calloc(hdr.count ? hdr.count : 1, sizeof(struct tag_bulk_entry));
+    if(ents == NULL)
+    {
+        printf("Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t pos = sizeof(hdr), count = 0, missing = 0;
+    char name [TAG_NAME_LENGTH];
+    for(uint32_t i = 0; i < hdr.count; i++)
+    {
+        uint8_t len = pos < size ? (uint8_t)data[pos] : 0;
+        if(pos + 1 + len + sizeof(tagx_t) > size)
+        {
+            printf("%s is truncated.\n", path);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(name, data + pos + 1, len);
+        name[len] = 0;
+        pos += 1 + len;
+
+        struct named_tag key = { .name = name };
+        struct named_tag * t = bsearch(&key, list.tags, list.count, sizeof(struct named_tag), compareNames);
+        if(t == NULL)
+        {
+            missing++;
+        }
+        else
+        {
+            ents[count].id = t->id;
+            memcpy(&ents[count].tag, data + pos, sizeof(tagx_t));
+            count++;
+        }
+        pos += sizeof(tagx_t);
+    }
+
+    openBulkOrDie(&bulkfd);
+    if(count && !bulkWriteTags(bulkfd, ents, count, TAGFD_FLAG_EXTENDED))
+    {
+        printf("Couldn't write the tags: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(bulkfd);
+
+    size_t restored = 0, retyped = 0, written = 0, failed = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        switch(-ents[i].status)
+        {
+            case 0:      restored++; break;
+            case EPERM:  retyped++;  break;
+            case EINVAL: written++;  break;
+            default:     failed++;   break;
+        }
+    }
+
+    printf("Restored %zu tags from %s in %.3f ms\n", restored, path, (now_ns() - start) / 1e6);
+    if(missing)
+        printf("%zu saved tags don't exist any more\n", missing);
+    if(retyped)
+        printf("%zu tags have a different data type now\n", retyped);
+    if(written)
+        printf("%zu tags have already been written since they were created\n", written);
+    if(failed)
+        printf("%zu tags couldn't be written\n", failed);
+}
+
+int main(int argc, char ** argv)
+{
+    if(argc != 3)
+        usage();
+
+    if(!strcmp(argv[1], "save"))
+        save(argv[2]);
+    else if(!strcmp(argv[1], "restore"))
+        restore(argv[2]);
+    else
+        usage();
+
+    exit(EXIT_SUCCESS);
+}